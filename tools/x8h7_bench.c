@@ -0,0 +1,177 @@
+/**
+ * X8H7 link benchmark, drives /dev/x8h7_echo
+ * Needs the x8h7_echo module and an H7 firmware with the echo peripheral.
+ *
+ *   x8h7_bench [-d device] [-n count] [-s size] [-b batch] [rtt|sync|defer|stream]...
+ *
+ * With no test named all of them run, sync and defer on the same
+ * packets so the batching gain shows directly.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../x8h7_ioctl.h"
+
+static const char *mode_names[] = {
+  [X8H7_ECHO_BENCH_RTT]    = "rtt",
+  [X8H7_ECHO_BENCH_SYNC]   = "sync",
+  [X8H7_ECHO_BENCH_DEFER]  = "defer",
+  [X8H7_ECHO_BENCH_STREAM] = "stream",
+};
+
+#define MODE_NUM  (sizeof(mode_names) / sizeof(mode_names[0]))
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t  x = *(const uint32_t *)a;
+  uint32_t  y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(const uint32_t *sorted, uint32_t n, double p)
+{
+  uint32_t  idx = (uint32_t)(p / 100.0 * (n - 1) + 0.5);
+
+  return sorted[idx] / 1000.0;
+}
+
+static int run(int fd, struct x8h7_echo_bench *b, uint32_t *lat)
+{
+  b->lat_ns = (uintptr_t)lat;
+  if (ioctl(fd, X8H7_IOCTL_ECHO_BENCH, b) < 0) {
+    fprintf(stderr, "%s: %s\n", mode_names[b->mode], strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void report(const struct x8h7_echo_bench *b)
+{
+  double  sec = b->elapsed_ns / 1e9;
+
+  printf("%-6s %8u pkts %4u B  %9.3f ms  %10.0f pkt/s  tx %7.3f MB/s  rx %7.3f MB/s  errors %u\n",
+         mode_names[b->mode], b->count, b->size, b->elapsed_ns / 1e6,
+         sec > 0 ? b->count / sec : 0.0,
+         sec > 0 ? b->tx_bytes / sec / 1e6 : 0.0,
+         sec > 0 ? b->rx_bytes / sec / 1e6 : 0.0,
+         b->errors);
+}
+
+static void report_rtt(uint32_t *lat, uint32_t n)
+{
+  qsort(lat, n, sizeof(*lat), cmp_u32);
+  printf("rtt us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+         lat[0] / 1000.0, percentile(lat, n, 50), percentile(lat, n, 90),
+         percentile(lat, n, 99), percentile(lat, n, 99.9), lat[n - 1] / 1000.0);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-d device] [-n count] [-s size] [-b batch] "
+                  "[rtt|sync|defer|stream]...\n"
+                  "  -b 0 fills whole frames before sending, the default\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  const char             *dev = "/dev/x8h7_echo";
+  struct x8h7_echo_bench  b;
+  uint32_t                count = 10000;
+  uint32_t                size = 32;
+  uint32_t                batch = 0;
+  int                     modes[MODE_NUM] = { 0 };
+  uint64_t                sync_ns = 0;
+  uint64_t                defer_ns = 0;
+  uint32_t               *lat;
+  unsigned int            m;
+  int                     any = 0;
+  int                     ret = 0;
+  int                     fd;
+  int                     opt;
+  int                     i;
+
+  while ((opt = getopt(argc, argv, "d:n:s:b:h")) != -1) {
+    switch (opt) {
+    case 'd': dev = optarg; break;
+    case 'n': count = strtoul(optarg, NULL, 0); break;
+    case 's': size = strtoul(optarg, NULL, 0); break;
+    case 'b': batch = strtoul(optarg, NULL, 0); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  for (i = optind; i < argc; i++) {
+    for (m = 0; m < MODE_NUM; m++) {
+      if (!strcmp(argv[i], mode_names[m])) {
+        modes[m] = any = 1;
+        break;
+      }
+    }
+    if (m == MODE_NUM) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!any) {
+    for (m = 0; m < MODE_NUM; m++) {
+      modes[m] = 1;
+    }
+  }
+  if (!count || (count > X8H7_ECHO_COUNT_MAX) ||
+      (size < X8H7_ECHO_SIZE_MIN) || (size > X8H7_ECHO_SIZE_MAX)) {
+    fprintf(stderr, "count must be 1..%u, size %u..%u\n",
+            X8H7_ECHO_COUNT_MAX, X8H7_ECHO_SIZE_MIN, X8H7_ECHO_SIZE_MAX);
+    return 1;
+  }
+
+  lat = calloc(count, sizeof(*lat));
+  if (!lat) {
+    perror("calloc");
+    return 1;
+  }
+  fd = open(dev, O_RDWR);
+  if (fd < 0) {
+    perror(dev);
+    free(lat);
+    return 1;
+  }
+
+  for (m = 0; m < MODE_NUM; m++) {
+    if (!modes[m]) {
+      continue;
+    }
+    memset(&b, 0, sizeof(b));
+    b.mode  = m;
+    b.count = count;
+    b.size  = size;
+    b.batch = batch;
+    if (run(fd, &b, (m == X8H7_ECHO_BENCH_RTT) ? lat : NULL) < 0) {
+      ret = 1;
+      continue;
+    }
+    report(&b);
+    if (m == X8H7_ECHO_BENCH_RTT) {
+      report_rtt(lat, count);
+    } else if (m == X8H7_ECHO_BENCH_SYNC) {
+      sync_ns = b.elapsed_ns;
+    } else if (m == X8H7_ECHO_BENCH_DEFER) {
+      defer_ns = b.elapsed_ns;
+    }
+  }
+  if (sync_ns && defer_ns) {
+    printf("defer speedup over sync: %.2fx\n", (double)sync_ns / defer_ns);
+  }
+
+  close(fd);
+  free(lat);
+  return ret;
+}
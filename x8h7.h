@@ -4,10 +4,18 @@
 #ifndef __X8H7_H
 #define __X8H7_H
 
+#include <linux/completion.h>
+
 #define X8H7_RX_TIMEOUT (HZ/10)
 
-#define X8H7_BUF_SIZE   (256)
+/* Default SPI frame length, "spi-fixed-length" may set it up to X8H7_BUF_SIZE_MAX */
+#define X8H7_BUF_SIZE      (256)
+#define X8H7_BUF_SIZE_MAX  (4096)
 #define FIXED_PACKET_LEN  X8H7_BUF_SIZE
+/* Peripheral ids are below this, size of the dispatch table */
+#define X8H7_PERIPH_NUM   16
+
+/* Max sub packet payload, a full sub packet always fits the smallest frame */
 #define X8H7_PKT_SIZE   (X8H7_BUF_SIZE - 8)
 
 typedef struct {
@@ -17,11 +25,41 @@ typedef struct {
   uint8_t   data[X8H7_PKT_SIZE];
 } x8h7_pkt_t;
 
-typedef void (*x8h7_hook_t)(void *priv, x8h7_pkt_t *pkt);
+/* Receive hook, data points into the RX frame and may be unaligned.
+ * Called under RCU read lock from the SPI thread, it must not sleep.
+ */
+typedef void (*x8h7_hook_t)(void *priv, uint8_t opcode, const uint8_t *data,
+                            uint16_t size);
+/* Like x8h7_hook_t, for taps spanning several peripherals */
+typedef void (*x8h7_tap_t)(void *priv, uint8_t peripheral, uint8_t opcode,
+                           const uint8_t *data, uint16_t size);
+
+/* Link policies, see x8h7_link_policy_set */
+enum x8h7_link_policy {
+  X8H7_LINK_PERFORMANCE,
+  X8H7_LINK_POWERSAVE,
+  X8H7_LINK_LOWLATENCY,
+  X8H7_LINK_POLICY_NUM,
+};
+
+struct x8h7_req;
+struct kvec;
 
 int x8h7_pkt_send_sync(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data);
 int x8h7_pkt_send_defer(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data);
+int x8h7_pkt_send_defer_v(uint8_t peripheral, uint8_t opcode,
+                          const struct kvec *iov, int cnt);
+uint16_t x8h7_pkt_room(void);
 int x8h7_pkt_send_now(void);
+int x8h7_pkt_send_async(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data,
+                        struct completion *done);
+struct x8h7_req *x8h7_req_submit(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data);
+int x8h7_req_wait(struct x8h7_req *req, x8h7_pkt_t *rsp, long timeout);
+int x8h7_pkt_send_recv(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data,
+                       x8h7_pkt_t *rsp);
 int x8h7_hook_set(uint8_t idx, x8h7_hook_t hook, void *priv);
+int x8h7_tap_set(u32 mask, x8h7_tap_t hook, void *priv);
+int x8h7_link_policy_set(enum x8h7_link_policy policy);
+enum x8h7_link_policy x8h7_link_policy_get(void);
 int x8h7_dbg_set(void (*hook)(void*, uint8_t*, uint16_t), void *priv);
 #endif  /* __X8H7_H */
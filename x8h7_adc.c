@@ -6,11 +6,14 @@
 #include <linux/err.h>
 #include <linux/iio/iio.h>
 #include <linux/iio/driver.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/iio/sysfs.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
-#include <linux/wait.h>
+#include <asm/unaligned.h>
 
 #include "x8h7.h"
 
@@ -24,19 +27,39 @@
 // Op code
 #define X8H7_ADC_OC_CONFIGURE      0x10
 #define X8H7_ADC_OC_DATA           0x01
+#define X8H7_ADC_OC_STREAM_START   0x20
+#define X8H7_ADC_OC_STREAM_STOP    0x21
+#define X8H7_ADC_OC_SCAN           0x22
+#define X8H7_ADC_OC_STREAM_DATA    0x30
 
 #define X8H7_ADC_NUM  8
 
-struct x8h7_adc_val {
-  uint16_t            val;
-  wait_queue_head_t   wait;
-  int                 cnt;
+#define X8H7_ADC_RATE_DEFAULT   1000
+#define X8H7_ADC_RATE_MAX     100000
+
+/* X8H7_ADC_OC_STREAM_START payload, sampling paced by the H7 */
+struct __attribute__((packed)) x8h7_adc_stream_message {
+  uint8_t  mask;
+  uint32_t rate;
 };
 
+/* X8H7_ADC_OC_SCAN request carries the channel mask, the response the
+ * mask then one uint16_t per channel in it, in channel order.
+ */
+
+/* X8H7_ADC_OC_STREAM_DATA carries the channel mask, then scans of
+ * one uint16_t sample per enabled channel in channel order.
+ */
+
 struct x8h7_adc {
   struct device      *dev;
-  struct mutex        lock;
-  struct x8h7_adc_val val[X8H7_ADC_NUM];
+  uint32_t            rate;
+  uint8_t             mask;   // channels the H7 is streaming
+  bool                scan_op;  // H7 handles X8H7_ADC_OC_SCAN
+  struct {
+    uint16_t          chan[X8H7_ADC_NUM];
+    s64               ts __aligned(8);
+  } scan;
 };
 
 #define X8H7_ADC_CHAN(_idx) {                          \
@@ -45,6 +68,14 @@ struct x8h7_adc {
   .channel                  = _idx,                    \
   .info_mask_separate       = BIT(IIO_CHAN_INFO_RAW),  \
   .info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),\
+  .info_mask_shared_by_all  = BIT(IIO_CHAN_INFO_SAMP_FREQ),\
+  .scan_index               = _idx,                    \
+  .scan_type = {                                       \
+    .sign                   = 'u',                     \
+    .realbits               = 16,                      \
+    .storagebits            = 16,                      \
+    .endianness             = IIO_CPU,                 \
+  },                                                   \
 }
 
 static const struct iio_chan_spec x8h7_adc_iio_channels[] = {
@@ -56,59 +87,208 @@ static const struct iio_chan_spec x8h7_adc_iio_channels[] = {
   X8H7_ADC_CHAN(5),
   X8H7_ADC_CHAN(6),
   X8H7_ADC_CHAN(7),
+  IIO_CHAN_SOFT_TIMESTAMP(X8H7_ADC_NUM),
 };
 
-static void x8h7_adc_hook(void *priv, x8h7_pkt_t *pkt)
+/**
+ * Sample blocks streamed by the H7, pushed straight into the buffer.
+ * Runs in the SPI thread, timestamps are spread back from arrival.
+ */
+static void x8h7_adc_hook(void *priv, uint8_t opcode, const uint8_t *buf,
+                          uint16_t size)
 {
-  struct x8h7_adc  *adc = (struct x8h7_adc*)priv;
-  uint8_t           ch;
-
-  ch = pkt->opcode - 1;
-  if (ch < X8H7_ADC_NUM) {
-    adc->val[ch].val = *((uint16_t*)pkt->data);
-    adc->val[ch].cnt++;
-    wake_up_interruptible(&adc->val[ch].wait);
+  struct iio_dev   *indio_dev = priv;
+  struct x8h7_adc  *adc = iio_priv(indio_dev);
+  const uint16_t   *data;
+  unsigned int      n;
+  unsigned int      scans;
+  unsigned int      i;
+  unsigned int      j;
+  unsigned int      ch;
+  s64               ts;
+  s64               period;
+  uint8_t           mask;
+
+  if ((opcode != X8H7_ADC_OC_STREAM_DATA) || (size < 1)) {
+    return;
+  }
+  /* Cleared before the stream is stopped, blocks after that are dropped */
+  mask = READ_ONCE(adc->mask);
+  if (!mask || (buf[0] != mask)) {
+    DBG_PRINT("drop block of mask %02X\n", buf[0]);
+    return;
+  }
+
+  n = hweight8(mask);
+  scans = (size - 1) / (n * sizeof(uint16_t));
+  data = (const uint16_t *)&buf[1];
+  ts = iio_get_time_ns(indio_dev);
+  period = NSEC_PER_SEC / adc->rate;
+
+  for (i = 0; i < scans; i++) {
+    j = 0;
+    for_each_set_bit(ch, indio_dev->active_scan_mask, X8H7_ADC_NUM) {
+      adc->scan.chan[j] = get_unaligned(&data[i * n + j]);
+      j++;
+    }
+    iio_push_to_buffers_with_timestamp(indio_dev, &adc->scan,
+                                       ts - (scans - 1 - i) * period);
   }
 }
 
-static int x8h7_adc_pkt_get(struct x8h7_adc *adc, unsigned int ch)
+static int x8h7_adc_buffer_postenable(struct iio_dev *indio_dev)
 {
-  long ret;
-
-  ret = wait_event_interruptible_timeout(adc->val[ch].wait,
-                                         adc->val[ch].cnt != 0,
-                                         X8H7_RX_TIMEOUT);
-  if (!ret) {
-    DBG_ERROR("timeout expired");
-    return -1;
+  struct x8h7_adc                *adc = iio_priv(indio_dev);
+  struct x8h7_adc_stream_message  msg;
+  int                             ret;
+
+  msg.mask = *indio_dev->active_scan_mask & GENMASK(X8H7_ADC_NUM - 1, 0);
+  msg.rate = adc->rate;
+  WRITE_ONCE(adc->mask, msg.mask);
+  DBG_PRINT("start mask %02X rate %d\n", msg.mask, msg.rate);
+  ret = x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_STREAM_START,
+                           sizeof(msg), &msg);
+  if (ret < 0) {
+    WRITE_ONCE(adc->mask, 0);
   }
-  adc->val[ch].cnt--;
-  return 0;
+  return ret;
+}
+
+static int x8h7_adc_buffer_predisable(struct iio_dev *indio_dev)
+{
+  struct x8h7_adc  *adc = iio_priv(indio_dev);
+  int               ret;
+
+  WRITE_ONCE(adc->mask, 0);
+  ret = x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_STREAM_STOP, 0, NULL);
+  DBG_PRINT("stop\n");
+  return ret;
 }
 
+static const struct iio_buffer_setup_ops x8h7_adc_buffer_ops = {
+  .postenable = x8h7_adc_buffer_postenable,
+  .predisable = x8h7_adc_buffer_predisable,
+};
+
 static int x8h7_adc_read_chan(struct x8h7_adc *adc, unsigned int ch)
 {
-  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, ch + 1, 0, NULL);
-  if (x8h7_adc_pkt_get(adc, ch) < 0)
-    return -ETIMEDOUT;
+  x8h7_pkt_t  rsp;
+  int         ret;
+
+  ret = x8h7_pkt_send_recv(X8H7_ADC_PERIPH, ch + 1, 0, NULL, &rsp);
+  if (ret < 0)
+    return ret;
+  if (rsp.size < 2)
+    return -EIO;
+
+  return *((uint16_t*)rsp.data);
+}
+
+/**
+ * Read all the channels in one SPI transaction. Without X8H7_ADC_OC_SCAN
+ * the per channel requests are queued in the same frame.
+ */
+static int x8h7_adc_read_scan(struct x8h7_adc *adc, uint16_t *val)
+{
+  struct x8h7_req  *req[X8H7_ADC_NUM];
+  x8h7_pkt_t        rsp;
+  uint8_t           mask = GENMASK(X8H7_ADC_NUM - 1, 0);
+  int               ret = 0;
+  int               err;
+  int               n = 0;
+  int               i;
+
+  if (adc->scan_op) {
+    ret = x8h7_pkt_send_recv(X8H7_ADC_PERIPH, X8H7_ADC_OC_SCAN, 1, &mask, &rsp);
+    if (ret < 0)
+      return ret;
+    if ((rsp.size != 1 + X8H7_ADC_NUM * sizeof(uint16_t)) ||
+        (rsp.data[0] != mask))
+      return -EIO;
+    memcpy(val, &rsp.data[1], X8H7_ADC_NUM * sizeof(uint16_t));
+    return 0;
+  }
+
+  for (i = 0; i < X8H7_ADC_NUM; i++) {
+    req[i] = x8h7_req_submit(X8H7_ADC_PERIPH, i + 1, 0, NULL);
+    if (IS_ERR(req[i])) {
+      ret = PTR_ERR(req[i]);
+      break;
+    }
+    n++;
+  }
+  x8h7_pkt_send_now();
+  for (i = 0; i < n; i++) {
+    err = x8h7_req_wait(req[i], &rsp, X8H7_RX_TIMEOUT);
+    if ((err == 0) && (rsp.size < 2))
+      err = -EIO;
+    if (err < 0) {
+      ret = ret ? ret : err;
+      continue;
+    }
+    val[i] = get_unaligned((uint16_t *)rsp.data);
+  }
+  return ret;
+}
+
+static ssize_t x8h7_adc_scan_raw_show(struct device *dev,
+                                      struct device_attribute *attr, char *buf)
+{
+  struct iio_dev   *indio_dev = dev_to_iio_dev(dev);
+  struct x8h7_adc  *adc = iio_priv(indio_dev);
+  uint16_t          val[X8H7_ADC_NUM];
+  ssize_t           len = 0;
+  int               ret;
+  int               i;
+
+  ret = iio_device_claim_direct_mode(indio_dev);
+  if (ret)
+    return ret;
+  ret = x8h7_adc_read_scan(adc, val);
+  iio_device_release_direct_mode(indio_dev);
+  if (ret < 0)
+    return ret;
 
-  return adc->val[ch].val;
+  for (i = 0; i < X8H7_ADC_NUM; i++)
+    len += sysfs_emit_at(buf, len, "%u%c", val[i],
+                         (i == X8H7_ADC_NUM - 1) ? '\n' : ' ');
+  return len;
 }
 
+static IIO_DEVICE_ATTR(scan_raw, 0444, x8h7_adc_scan_raw_show, NULL, 0);
+
+static struct attribute *x8h7_adc_attrs[] = {
+  &iio_dev_attr_scan_raw.dev_attr.attr,
+  NULL,
+};
+
+static const struct attribute_group x8h7_adc_attr_group = {
+  .attrs = x8h7_adc_attrs,
+};
+
 static int x8h7_adc_read_raw(struct iio_dev *indio_dev,
                              struct iio_chan_spec const *chan,
                              int *val, int *val2, long mask)
 {
   struct x8h7_adc *adc = iio_priv(indio_dev);
+  int              ret;
 
   switch (mask) {
   case IIO_CHAN_INFO_RAW:
-    mutex_lock(&adc->lock);
-    *val = x8h7_adc_read_chan(adc, chan->channel);
-    mutex_unlock(&adc->lock);
-    if (*val == -1) {
-      return -EIO;
+    ret = iio_device_claim_direct_mode(indio_dev);
+    if (ret) {
+      return ret;
+    }
+    ret = x8h7_adc_read_chan(adc, chan->channel);
+    iio_device_release_direct_mode(indio_dev);
+    if (ret < 0) {
+      return ret;
     }
+    *val = ret;
+    return IIO_VAL_INT;
+
+  case IIO_CHAN_INFO_SAMP_FREQ:
+    *val = adc->rate;
     return IIO_VAL_INT;
 
   case IIO_CHAN_INFO_SCALE:
@@ -123,16 +303,53 @@ static int x8h7_adc_read_raw(struct iio_dev *indio_dev,
   return -EINVAL;
 }
 
+static int x8h7_adc_write_raw(struct iio_dev *indio_dev,
+                              struct iio_chan_spec const *chan,
+                              int val, int val2, long mask)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+  int              ret;
+
+  switch (mask) {
+  case IIO_CHAN_INFO_SAMP_FREQ:
+    if ((val <= 0) || (val > X8H7_ADC_RATE_MAX)) {
+      return -EINVAL;
+    }
+    ret = iio_device_claim_direct_mode(indio_dev);
+    if (ret) {
+      return ret;
+    }
+    adc->rate = val;
+    iio_device_release_direct_mode(indio_dev);
+    return 0;
+  }
+
+  return -EINVAL;
+}
+
 static const struct iio_info x8h7_adc_info = {
-  .read_raw = x8h7_adc_read_raw,
+  .read_raw  = x8h7_adc_read_raw,
+  .write_raw = x8h7_adc_write_raw,
+  .attrs     = &x8h7_adc_attr_group,
 };
 
+/**
+ * Older H7 firmware does not answer X8H7_ADC_OC_SCAN, probe it once
+ */
+static void x8h7_adc_scan_probe(struct x8h7_adc *adc)
+{
+  uint16_t  val[X8H7_ADC_NUM];
+
+  adc->scan_op = true;
+  adc->scan_op = (x8h7_adc_read_scan(adc, val) == 0);
+  DBG_PRINT("scan opcode %ssupported\n", adc->scan_op ? "" : "not ");
+}
+
 static int x8h7_adc_probe(struct platform_device *pdev)
 {
   struct iio_dev   *indio_dev;
   struct x8h7_adc  *adc;
   int               ret;
-  int               i;
 
   indio_dev = devm_iio_device_alloc(&pdev->dev, sizeof(*adc));
   if (!indio_dev) {
@@ -142,14 +359,7 @@ static int x8h7_adc_probe(struct platform_device *pdev)
   platform_set_drvdata(pdev, indio_dev);
   adc = iio_priv(indio_dev);
   adc->dev = &pdev->dev;
-  mutex_init(&adc->lock);
-#if 0
-  init_waitqueue_head(&adc->wait);
-#else
-  for (i=0; i<X8H7_ADC_NUM; i++) {
-    init_waitqueue_head(&adc->val[i].wait);
-  }
-#endif
+  adc->rate = X8H7_ADC_RATE_DEFAULT;
   indio_dev->name         = dev_name(&pdev->dev);
   indio_dev->dev.parent   = &pdev->dev;
   indio_dev->info         = &x8h7_adc_info;
@@ -157,19 +367,29 @@ static int x8h7_adc_probe(struct platform_device *pdev)
   indio_dev->channels     = x8h7_adc_iio_channels;
   indio_dev->num_channels = ARRAY_SIZE(x8h7_adc_iio_channels);
 
-  ret = iio_device_register(indio_dev);
+  ret = devm_iio_kfifo_buffer_setup(&pdev->dev, indio_dev,
+                                    &x8h7_adc_buffer_ops);
   if (ret) {
-    dev_err(&pdev->dev, "unable to register device\n");
+    dev_err(&pdev->dev, "unable to setup buffer\n");
     return ret;
   }
 
-  x8h7_hook_set(X8H7_ADC_PERIPH, x8h7_adc_hook, adc);
+  x8h7_hook_set(X8H7_ADC_PERIPH, x8h7_adc_hook, indio_dev);
+  x8h7_adc_scan_probe(adc);
+
+  ret = devm_iio_device_register(&pdev->dev, indio_dev);
+  if (ret) {
+    dev_err(&pdev->dev, "unable to register device\n");
+    x8h7_hook_set(X8H7_ADC_PERIPH, NULL, NULL);
+    return ret;
+  }
 
   return 0;
 }
 
 static int x8h7_adc_remove(struct platform_device *pdev)
 {
+  x8h7_hook_set(X8H7_ADC_PERIPH, NULL, NULL);
   return 0;
 }
 
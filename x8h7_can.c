@@ -43,7 +43,7 @@
 
 /**
  * Those parameters are valid for the STM32H7 CAN driver using
- * CAN classic. For CAN FD different values are needed.
+ * CAN classic and for the CAN FD nominal (arbitration) phase.
  */
 static const struct can_bittiming_const x8h7_can_bittiming_const = {
   .name      = DRIVER_NAME,   /* Name of the CAN controller hardware */
@@ -57,19 +57,45 @@ static const struct can_bittiming_const x8h7_can_bittiming_const = {
   .brp_inc   =   1,
 };
 
+/**
+ * STM32H7 FDCAN data phase bit timing, used with bit rate switching.
+ */
+static const struct can_bittiming_const x8h7_can_data_bittiming_const = {
+  .name      = DRIVER_NAME,
+  .tseg1_min =   1,
+  .tseg1_max =  32,
+  .tseg2_min =   1,
+  .tseg2_max =  16,
+  .sjw_max   =  16,
+  .brp_min   =   1,
+  .brp_max   =  32,
+  .brp_inc   =   1,
+};
+
 static void x8h7_can_tx_work_handler(struct work_struct *ws);
+static int x8h7_can_hw_do_set_data_bittiming(struct net_device *net);
 static void x8h7_can_error_skb(struct net_device *net, int can_id, int data1);
 
 /**
+ * Classic and FD frames are stored in the same layout, FDF marks the latter
  */
-static void x8h7_can_frame_to_tx_obj(struct can_frame const *frame, union x8h7_can_frame_message *x8h7_can_msg)
+static void x8h7_can_skb_to_tx_obj(struct sk_buff *skb, union x8h7_canfd_frame_message *x8h7_can_msg)
 {
+  struct canfd_frame const *frame = (struct canfd_frame *)skb->data;
+
   if (frame->can_id & CAN_EFF_FLAG)
     x8h7_can_msg->field.id  = CAN_EFF_FLAG | (frame->can_id & CAN_EFF_MASK);
   else
     x8h7_can_msg->field.id  =                (frame->can_id & CAN_SFF_MASK);
 
-  x8h7_can_msg->field.len = (frame->can_dlc <= X8H7_CAN_FRAME_MAX_DATA_LEN) ? frame->can_dlc : X8H7_CAN_FRAME_MAX_DATA_LEN;
+  if (can_is_canfd_skb(skb)) {
+    x8h7_can_msg->field.len   = min_t(u8, frame->len, X8H7_CANFD_FRAME_MAX_DATA_LEN);
+    x8h7_can_msg->field.flags = X8H7_CANFD_FLG_FDF |
+                                (frame->flags & (CANFD_BRS | CANFD_ESI));
+  } else {
+    x8h7_can_msg->field.len   = min_t(u8, frame->len, X8H7_CAN_FRAME_MAX_DATA_LEN);
+    x8h7_can_msg->field.flags = 0;
+  }
   memcpy(x8h7_can_msg->field.data, frame->data, x8h7_can_msg->field.len);
 }
 
@@ -88,6 +114,81 @@ static char* can_sts(enum can_state sts)
   }
 }
 
+/**
+ * Error state from the counters, as defined by ISO 11898-1
+ */
+static enum can_state x8h7_can_cnt_state(u16 cnt)
+{
+  if (cnt >= 256)
+    return CAN_STATE_BUS_OFF;
+  if (cnt >= 128)
+    return CAN_STATE_ERROR_PASSIVE;
+  if (cnt >= 96)
+    return CAN_STATE_ERROR_WARNING;
+  return CAN_STATE_ERROR_ACTIVE;
+}
+
+/**
+ * Track error state transitions from the H7 flags and counters
+ */
+static void x8h7_can_state(struct x8h7_can_priv *priv, u8 eflag, bool cnt)
+{
+  struct net_device  *net = priv->net;
+  struct sk_buff     *skb;
+  struct can_frame   *cf;
+  enum can_state      tx_state = CAN_STATE_ERROR_ACTIVE;
+  enum can_state      rx_state = CAN_STATE_ERROR_ACTIVE;
+  enum can_state      old_state = priv->can.state;
+
+  if (eflag & X8H7_CAN_STS_FLG_TX_BO) {
+    tx_state = CAN_STATE_BUS_OFF;
+  } else if (eflag & X8H7_CAN_STS_FLG_TX_EP) {
+    tx_state = CAN_STATE_ERROR_PASSIVE;
+  } else if (eflag & (X8H7_CAN_STS_FLG_TX_WAR | X8H7_CAN_STS_FLG_EWARN)) {
+    tx_state = CAN_STATE_ERROR_WARNING;
+  }
+  if (eflag & X8H7_CAN_STS_FLG_RX_EP) {
+    rx_state = CAN_STATE_ERROR_PASSIVE;
+  } else if (eflag & (X8H7_CAN_STS_FLG_RX_WAR | X8H7_CAN_STS_FLG_EWARN)) {
+    rx_state = CAN_STATE_ERROR_WARNING;
+  }
+  if (cnt) {
+    tx_state = max(tx_state, x8h7_can_cnt_state(priv->bec.txerr));
+    rx_state = min(max(rx_state, x8h7_can_cnt_state(priv->bec.rxerr)),
+                   CAN_STATE_ERROR_PASSIVE);
+  }
+
+  if (max(tx_state, rx_state) == old_state) {
+    return;
+  }
+  DBG_CAN_STATE(net->name, max(tx_state, rx_state));
+
+  /* Only the side responsible for the transition is reported */
+  if (tx_state < rx_state) {
+    tx_state = 0;
+  } else if (rx_state < tx_state) {
+    rx_state = 0;
+  }
+
+  skb = alloc_can_err_skb(net, &cf);
+  can_change_state(net, skb ? cf : NULL, tx_state, rx_state);
+  if (skb) {
+    cf->can_id |= CAN_ERR_CNT;
+    cf->data[6] = priv->bec.txerr;
+    cf->data[7] = priv->bec.rxerr;
+    netif_rx(skb);
+  }
+
+  if (priv->can.state == CAN_STATE_BUS_OFF) {
+    can_bus_off(net);
+  } else if (old_state == CAN_STATE_BUS_OFF) {
+    /* The H7 recovered on its own */
+    priv->can.can_stats.restarts++;
+    netif_carrier_on(net);
+    netif_wake_queue(net);
+  }
+}
+
 /**
  */
 static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
@@ -95,6 +196,7 @@ static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
   struct net_device  *net = priv->net;
   int                 can_id = 0;
   int                 data1 = 0;
+  bool                freed = false;
 
   //DBG_PRINT("\n");
 
@@ -121,11 +223,21 @@ static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
 
   if (intf & X8H7_CAN_STS_INT_TX_COMPLETE) {
     DBG_PRINT("TX COMPLETE");
-    net->stats.tx_packets++;
-    net->stats.tx_bytes += priv->tx_len;
-    priv->tx_len = 0;
-    can_get_echo_skb(net, 0, NULL);
-    netif_wake_queue(net);
+    /* The H7 completes frames in order, one per status.
+     * Only bottom halves are disabled, can_get_echo_skb may call netif_rx.
+     */
+    spin_lock_bh(&priv->tx_lock);
+    if (priv->tx_tail != priv->tx_send) {
+      net->stats.tx_packets++;
+      net->stats.tx_bytes += can_get_echo_skb(net, priv->tx_tail % X8H7_TX_FIFO_SIZE, NULL);
+      priv->tx_tail++;
+      freed = true;
+    }
+    spin_unlock_bh(&priv->tx_lock);
+    /* A spurious completion frees no slot, the ring may still be full */
+    if (freed) {
+      netif_wake_queue(net);
+    }
   }
 
   if (intf & X8H7_CAN_STS_INT_TX_ABORT_COMPLETE)
@@ -141,57 +253,136 @@ static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
 
 /**
  */
-static void x8h7_can_hook(void *arg, x8h7_pkt_t *pkt)
+static void x8h7_can_hook(void *arg, uint8_t opcode, const uint8_t *data,
+                          uint16_t size)
 {
   struct x8h7_can_priv  *priv = (struct x8h7_can_priv*)arg;
+  uint16_t               hdr_size;
+  uint16_t               max_len;
 
-  switch(pkt->opcode) {
+  if (opcode == X8H7_CAN_OC_RECV_FD) {
+    hdr_size = X8H7_CANFD_HEADER_SIZE;
+  } else {
+    hdr_size = X8H7_CAN_HEADER_SIZE;
+  }
+
+  switch(opcode) {
   case X8H7_CAN_OC_RECV:
-    if (pkt->size < X8H7_CAN_HEADER_SIZE) {
-      DBG_ERROR("received packed is too short (%d)\n", pkt->size);
+  case X8H7_CAN_OC_RECV_FD:
+    if (size < hdr_size) {
+      DBG_ERROR("received packed is too short (%d)\n", size);
       return;
     } else {
-      struct sk_buff   *skb;
-      struct can_frame *frame;
-      union x8h7_can_frame_message x8h7_can_msg;
+      union x8h7_canfd_frame_message x8h7_can_msg;
 
-      skb = alloc_can_skb(priv->net, &frame);
-      if (!skb) {
-        dev_err(priv->dev, "cannot allocate RX skb\n");
+      if (kfifo_is_full(&priv->rx_fifo)) {
+        priv->net->stats.rx_over_errors++;
         priv->net->stats.rx_dropped++;
         return;
       }
 
-      /* Copy header from raw byte-stream onto union. */
-      memcpy(x8h7_can_msg.buf, pkt->data, X8H7_CAN_HEADER_SIZE);
+      /* Classic frames are converted to the FD layout with no flags */
+      memset(x8h7_can_msg.buf, 0, sizeof(x8h7_can_msg.buf));
+      memcpy(x8h7_can_msg.buf, data, X8H7_CAN_HEADER_SIZE);
+      if (opcode == X8H7_CAN_OC_RECV_FD) {
+        x8h7_can_msg.field.flags = data[X8H7_CAN_HEADER_SIZE] | X8H7_CANFD_FLG_FDF;
+        max_len = X8H7_CANFD_FRAME_MAX_DATA_LEN;
+      } else {
+        max_len = X8H7_CAN_FRAME_MAX_DATA_LEN;
+      }
+      memcpy(x8h7_can_msg.field.data, data + hdr_size,
+             min_t(u16, size - hdr_size, max_len));
+      kfifo_put(&priv->rx_fifo, x8h7_can_msg);
+
+      /* We are in the SPI thread, let softirq run the poll on bh enable */
+      local_bh_disable();
+      napi_schedule(&priv->napi);
+      local_bh_enable();
+    }
+    break;
+  case X8H7_CAN_OC_STS:
+    if (size < X8H7_CAN_STS_SIZE) {
+      DBG_ERROR("received status is too short (%d)\n", size);
+      return;
+    }
+    DBG_PRINT("received status %02X %02X\n", data[0], data[1]);
+    if (size >= X8H7_CAN_STS_CNT_SIZE) {
+      priv->bec.txerr = data[2];
+      priv->bec.rxerr = data[3];
+    }
+    x8h7_can_status(priv, data[0], data[1]);
+    /* Flags are meaningful on error notifications, counters always */
+    if ((data[0] & X8H7_CAN_STS_INT_ERR) ||
+        (size >= X8H7_CAN_STS_CNT_SIZE)) {
+      x8h7_can_state(priv, data[1], size >= X8H7_CAN_STS_CNT_SIZE);
+    }
+    break;
+  }
+}
 
-      /* Extract can_id and can_dlc. Note: x8h7_can_frame_message uses the exact
-       * same flags for signaling extended/standard id mode or remote
-       * retransmit request as struct can_frame.
-       */
+/**
+ * NAPI poll, deliver the frames queued by the hook in a batch
+ */
+static int x8h7_can_poll(struct napi_struct *napi, int budget)
+{
+  struct x8h7_can_priv         *priv = container_of(napi, struct x8h7_can_priv, napi);
+  struct net_device            *net = priv->net;
+  union x8h7_canfd_frame_message  x8h7_can_msg;
+  struct sk_buff                 *skb;
+  struct canfd_frame             *frame;
+  int                             work = 0;
+
+  while ((work < budget) && kfifo_get(&priv->rx_fifo, &x8h7_can_msg)) {
+    work++;
+
+    if (x8h7_can_msg.field.flags & X8H7_CANFD_FLG_FDF) {
+      skb = alloc_canfd_skb(net, &frame);
+    } else {
+      skb = alloc_can_skb(net, (struct can_frame **)&frame);
+    }
+    if (!skb) {
+      dev_err(priv->dev, "cannot allocate RX skb\n");
+      net->stats.rx_dropped++;
+      continue;
+    }
 
-      frame->can_id  = x8h7_can_msg.field.id;
-      frame->can_dlc = x8h7_can_msg.field.len;
+    /* Extract can_id and len. Note: x8h7_canfd_frame_message uses the exact
+     * same flags for signaling extended/standard id mode or remote
+     * retransmit request as struct can_frame.
+     */
+    frame->can_id = x8h7_can_msg.field.id;
+    if (x8h7_can_msg.field.flags & X8H7_CANFD_FLG_FDF) {
+      /* Round up to a valid FD length, padding is already zero */
+      frame->len   = can_fd_dlc2len(can_fd_len2dlc(min_t(u8, x8h7_can_msg.field.len,
+                                                         X8H7_CANFD_FRAME_MAX_DATA_LEN)));
+      frame->flags = x8h7_can_msg.field.flags & (CANFD_BRS | CANFD_ESI);
+    } else {
+      frame->len   = min_t(u8, x8h7_can_msg.field.len, X8H7_CAN_FRAME_MAX_DATA_LEN);
+    }
 
-      DBG_PRINT("received data %X %X, copying to %X\n", frame->can_id, frame->can_dlc, frame->data);
+    DBG_PRINT("received data %X %X\n", frame->can_id, frame->len);
 
-      memcpy(frame->data, pkt->data + X8H7_CAN_HEADER_SIZE, frame->can_dlc);
+    memcpy(frame->data, x8h7_can_msg.field.data, frame->len);
+
+    net->stats.rx_packets++;
+    net->stats.rx_bytes += frame->len;
+    netif_receive_skb(skb);
+  }
 
-      priv->net->stats.rx_packets++;
-      priv->net->stats.rx_bytes += frame->can_dlc;
-      netif_rx(skb);
+  if (work < budget) {
+    napi_complete_done(napi, work);
+    /* A frame queued after the last get would wait for the next one */
+    if (!kfifo_is_empty(&priv->rx_fifo)) {
+      napi_schedule(napi);
     }
-    break;
-  case X8H7_CAN_OC_STS:
-    DBG_PRINT("received status %02X %02X\n", pkt->data[0], pkt->data[1]);
-    x8h7_can_status(priv, pkt->data[0], pkt->data[1]);
-    break;
   }
+
+  return work;
 }
 
 /*
- * device (auto-)restart mechanism runs in a timer context =>
- * MUST handle restart with asynchronous spi transfers (if any)
+ * device (auto-)restart mechanism runs from the candev restart work
+ * (or netlink), in process context, with the carrier still off
  */
 static int x8h7_can_restart(struct net_device *net)
 {
@@ -203,6 +394,16 @@ static int x8h7_can_restart(struct net_device *net)
   /* @TODO: notify external hw? */
   DBG_PRINT("@TODO: notify external hw?\n");
 
+  /* can_restart already flushed every echo skb and start_xmit can't run,
+   * drop what the ring still holds
+   */
+  cancel_work_sync(&priv->work);
+  spin_lock_bh(&priv->tx_lock);
+  priv->tx_head = 0;
+  priv->tx_send = 0;
+  priv->tx_tail = 0;
+  spin_unlock_bh(&priv->tx_lock);
+
   /* finally MUST update can state */
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
@@ -244,6 +445,10 @@ static int x8h7_can_hw_setup(struct x8h7_can_priv *priv)
 
   x8h7_pkt_send_sync(priv->periph, X8H7_CAN_OC_INIT, sizeof(x8h7_msg.buf), x8h7_msg.buf);
 
+  if (priv->can.ctrlmode & CAN_CTRLMODE_FD) {
+    x8h7_can_hw_do_set_data_bittiming(priv->net);
+  }
+
   return 0;
 }
 
@@ -301,7 +506,12 @@ static int x8h7_can_open(struct net_device *net)
     return ret;
   }
 
-  priv->tx_len  = 0;
+  priv->tx_head = 0;
+  priv->tx_send = 0;
+  priv->tx_tail = 0;
+  priv->bec.txerr = 0;
+  priv->bec.rxerr = 0;
+  priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
   priv->wq = alloc_workqueue("x8h7_can_wq", WQ_FREEZABLE | WQ_MEM_RECLAIM, 0);
   if (!priv->wq) {
@@ -320,15 +530,19 @@ static int x8h7_can_open(struct net_device *net)
   if (ret) {
     goto out_free_wq;
   }
+  kfifo_reset(&priv->rx_fifo);
+  napi_enable(&priv->napi);
   ret = x8h7_can_set_normal_mode(priv);
   if (ret) {
-    goto out_free_wq;
+    goto out_napi;
   }
 
   netif_start_queue(net);
 
   return 0;
 
+out_napi:
+  napi_disable(&priv->napi);
 out_free_wq:
   destroy_workqueue(priv->wq);
 out_clean:
@@ -356,6 +570,7 @@ static int x8h7_can_stop(struct net_device *net)
   /* Free priv. resources */
   mutex_lock(&priv->lock);
   x8h7_hook_set(priv->periph, NULL, NULL);
+  napi_disable(&priv->napi);
   destroy_workqueue(priv->wq);
   priv->wq = NULL;
 
@@ -371,47 +586,100 @@ static netdev_tx_t x8h7_can_start_xmit(struct sk_buff *skb,
                                        struct net_device *net)
 {
   struct x8h7_can_priv        *priv = netdev_priv(net);
-  const struct device         *dev = priv->dev;
-  struct can_frame            *frame;
+  unsigned int                 idx;
 
   DBG_PRINT("\n");
 
   if (can_dropped_invalid_skb(net, skb))
     return NETDEV_TX_OK;
 
-  netif_stop_queue(net);
+  spin_lock_bh(&priv->tx_lock);
+  idx = priv->tx_head % X8H7_TX_FIFO_SIZE;
+  x8h7_can_skb_to_tx_obj(skb, &priv->tx_ring[idx]);
+  can_put_echo_skb(skb, net, idx, 0);
+  priv->tx_head++;
+  /* Stop only when every slot is in use */
+  if ((priv->tx_head - priv->tx_tail) >= X8H7_TX_FIFO_SIZE) {
+    netif_stop_queue(net);
+  }
+  spin_unlock_bh(&priv->tx_lock);
 
-  frame = (struct can_frame *)skb->data;
-  x8h7_can_frame_to_tx_obj(frame, &priv->tx_frame);
-  can_put_echo_skb(skb, net, 0, 0);
   queue_work(priv->wq, &priv->work);
 
   return NETDEV_TX_OK;
 }
 
 /**
+ * Hand every queued frame to the H7: all of them but the last are
+ * deferred, so they are packed in as few SPI frames as possible, the
+ * last one kicks the SPI kthread.
  */
 static void x8h7_can_tx_work_handler(struct work_struct *ws)
 {
-  struct x8h7_can_priv *priv = container_of(ws, struct x8h7_can_priv, work);
+  struct x8h7_can_priv         *priv = container_of(ws, struct x8h7_can_priv, work);
+  union x8h7_canfd_frame_message  tx_frame;
+  union x8h7_can_frame_message    tx_msg;
+  uint8_t                        *buf;
+  uint8_t                         opcode;
+  uint16_t                        size;
+  bool                            last;
+  int                             ret;
+
+  for (;;) {
+    spin_lock_bh(&priv->tx_lock);
+    if (priv->tx_send == priv->tx_head) {
+      spin_unlock_bh(&priv->tx_lock);
+      break;
+    }
+    memcpy(&tx_frame, &priv->tx_ring[priv->tx_send % X8H7_TX_FIFO_SIZE], sizeof(tx_frame));
+    priv->tx_send++;
+    last = (priv->tx_send == priv->tx_head);
+    spin_unlock_bh(&priv->tx_lock);
 
 #ifdef DEBUG
-  char  data_str[X8H7_CAN_FRAME_MAX_DATA_LEN * 4];
-  int   i;
-  int   len;
-
-  i = 0; len = 0;
-  for (i = 0; (i < priv->tx_frame.field.len) && (len < sizeof(data_str)); i++)
-    len += snprintf(data_str + len, sizeof(data_str) - len, " %02X", priv->tx_frame.field.data[i]);
-  DBG_PRINT("Send CAN frame to H7: id = %08X, len = %d, data = [%s ]\n", priv->tx_frame.field.id, priv->tx_frame.field.len, data_str);
+    {
+      char  data_str[X8H7_CANFD_FRAME_MAX_DATA_LEN * 4];
+      int   i;
+      int   len;
+
+      i = 0; len = 0;
+      for (i = 0; (i < tx_frame.field.len) && (len < sizeof(data_str)); i++)
+        len += snprintf(data_str + len, sizeof(data_str) - len, " %02X", tx_frame.field.data[i]);
+      DBG_PRINT("Send CAN frame to H7: id = %08X, len = %d, flags = %02X, data = [%s ]\n",
+                tx_frame.field.id, tx_frame.field.len, tx_frame.field.flags, data_str);
+    }
 #endif
 
-  priv->tx_len = priv->tx_frame.field.len;
+    if (tx_frame.field.flags & X8H7_CANFD_FLG_FDF) {
+      /* Send 4-Byte ID, 1-Byte Length, 1-Byte flags and the data bytes. */
+      opcode = X8H7_CAN_OC_SEND_FD;
+      size   = X8H7_CANFD_HEADER_SIZE + tx_frame.field.len;
+      buf    = tx_frame.buf;
+    } else {
+      /* Send 4-Byte ID, 1-Byte Length and the required number of data bytes. */
+      tx_msg.field.id  = tx_frame.field.id;
+      tx_msg.field.len = tx_frame.field.len;
+      memcpy(tx_msg.field.data, tx_frame.field.data, tx_msg.field.len);
+      opcode = X8H7_CAN_OC_SEND;
+      size   = X8H7_CAN_HEADER_SIZE + tx_msg.field.len;
+      buf    = tx_msg.buf;
+    }
 
-  x8h7_pkt_send_sync(priv->periph,
-                     X8H7_CAN_OC_SEND,
-                     X8H7_CAN_HEADER_SIZE + priv->tx_frame.field.len, /* Send 4-Byte ID, 1-Byte Length and the required number of data bytes. */
-                     priv->tx_frame.buf);
+    if (last) {
+      /* Frame is copied at enqueue, the SPI kthread takes care of the transfer */
+      ret = x8h7_pkt_send_async(priv->periph, opcode, size, buf, NULL);
+    } else {
+      ret = x8h7_pkt_send_defer(priv->periph, opcode, size, buf);
+      if (ret == -ENOMEM) {
+        /* SPI frame is full, flush it */
+        x8h7_pkt_send_now();
+        ret = x8h7_pkt_send_defer(priv->periph, opcode, size, buf);
+      }
+    }
+    if (ret < 0) {
+      x8h7_pkt_send_sync(priv->periph, opcode, size, buf);
+    }
+  }
 }
 
 /**
@@ -440,9 +708,35 @@ static int x8h7_can_hw_do_set_bittiming(struct net_device *net)
   return 0;
 }
 
+/**
+ * Data phase bit timing, used by CAN FD frames with bit rate switching
+ */
+static int x8h7_can_hw_do_set_data_bittiming(struct net_device *net)
+{
+  struct x8h7_can_priv *priv = netdev_priv(net);
+  struct can_bittiming *dbt = &priv->can.data_bittiming;
+  union x8h7_can_bittiming_message x8h7_msg;
+
+  DBG_PRINT("\n");
+
+  x8h7_msg.field.baud_rate_prescaler = dbt->brp;
+  x8h7_msg.field.time_segment_1      = dbt->prop_seg + dbt->phase_seg1;
+  x8h7_msg.field.time_segment_2      = dbt->phase_seg2;
+  x8h7_msg.field.sync_jump_width     = dbt->sjw;
+
+  DBG_PRINT("data baud_rate_prescaler: %d, time_segment_1: %d, time_segment_2: %d, sync_jump_width: %d\n",
+            x8h7_msg.field.baud_rate_prescaler,
+            x8h7_msg.field.time_segment_1,
+            x8h7_msg.field.time_segment_2,
+            x8h7_msg.field.sync_jump_width);
+
+  x8h7_pkt_send_sync(priv->periph, X8H7_CAN_OC_DBITTIM, sizeof(x8h7_msg.buf), x8h7_msg.buf);
+
+  return 0;
+}
+
 /*
  * candev callback used to change CAN mode.
- * Warning: this is called from a timer context!
  */
 static int x8h7_can_do_set_mode(struct net_device *net, enum can_mode mode)
 {
@@ -469,9 +763,10 @@ static int x8h7_can_do_set_mode(struct net_device *net, enum can_mode mode)
 static int x8h7_can_do_get_berr_counter(const struct net_device *net,
                                         struct can_berr_counter *bec)
 {
-  //@TODO: to be read from device
-  bec->txerr = 0;
-  bec->rxerr = 0;
+  const struct x8h7_can_priv *priv = netdev_priv(net);
+
+  /* Cached from the status pushed by the H7, no SPI query needed */
+  *bec = priv->bec;
 
   return 0;
 }
@@ -482,7 +777,7 @@ static const struct net_device_ops x8h7_can_netdev_ops = {
   .ndo_open       = x8h7_can_open,
   .ndo_stop       = x8h7_can_stop,
   .ndo_start_xmit = x8h7_can_start_xmit,
-  //.ndo_change_mtu = can_change_mtu,
+  .ndo_change_mtu = can_change_mtu,
 };
 
 /**
@@ -505,6 +800,117 @@ static int x8h7_can_hw_config_filter(struct x8h7_can_priv *priv,
   return 0;
 }
 
+/**
+ * Queue a filter in the frame being filled, flushing it when full
+ */
+static int x8h7_can_hw_queue_filter(struct x8h7_can_priv *priv,
+                                    union x8h7_can_filter_message *x8h7_msg)
+{
+  int ret;
+
+  ret = x8h7_pkt_send_defer(priv->periph, X8H7_CAN_OC_FLT, sizeof(x8h7_msg->buf), x8h7_msg->buf);
+  if (ret == -ENOMEM) {
+    x8h7_pkt_send_now();
+    ret = x8h7_pkt_send_defer(priv->periph, X8H7_CAN_OC_FLT, sizeof(x8h7_msg->buf), x8h7_msg->buf);
+  }
+  return ret;
+}
+
+/**
+ * Bulk filters, binary table of union x8h7_can_filter_message.
+ * Entry i < X8H7_STD_FLT_MAX is standard filter i, the next
+ * X8H7_EXT_FLT_MAX are the extended filters with CAN_EFF_FLAG set in id.
+ */
+#define X8H7_FLT_MSG_SIZE   sizeof(union x8h7_can_filter_message)
+#define X8H7_FLT_TBL_SIZE   ((X8H7_STD_FLT_MAX + X8H7_EXT_FLT_MAX) * X8H7_FLT_MSG_SIZE)
+
+static ssize_t x8h7_can_flt_read(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *attr,
+                                 char *buf, loff_t off, size_t count)
+{
+  struct x8h7_can_priv          *priv = netdev_priv(to_net_dev(kobj_to_dev(kobj)));
+  union x8h7_can_filter_message  x8h7_msg;
+  size_t                         len = 0;
+  size_t                         n;
+  size_t                         o;
+  int                            i;
+
+  while ((len < count) && (off + len < X8H7_FLT_TBL_SIZE)) {
+    i = (off + len) / X8H7_FLT_MSG_SIZE;
+    o = (off + len) % X8H7_FLT_MSG_SIZE;
+    x8h7_msg.field.idx = i;
+    if (i < X8H7_STD_FLT_MAX) {
+      x8h7_msg.field.id   = priv->std_flt[i].can_id;
+      x8h7_msg.field.mask = priv->std_flt[i].can_mask;
+    } else {
+      x8h7_msg.field.idx  = i - X8H7_STD_FLT_MAX;
+      x8h7_msg.field.id   = CAN_EFF_FLAG | priv->ext_flt[x8h7_msg.field.idx].can_id;
+      x8h7_msg.field.mask = priv->ext_flt[x8h7_msg.field.idx].can_mask;
+    }
+    n = min(count - len, X8H7_FLT_MSG_SIZE - o);
+    memcpy(buf + len, x8h7_msg.buf + o, n);
+    len += n;
+  }
+  return len;
+}
+
+static ssize_t x8h7_can_flt_write(struct file *filp, struct kobject *kobj,
+                                  struct bin_attribute *attr,
+                                  char *buf, loff_t off, size_t count)
+{
+  struct x8h7_can_priv          *priv = netdev_priv(to_net_dev(kobj_to_dev(kobj)));
+  union x8h7_can_filter_message  x8h7_msg;
+  size_t                         n;
+  uint32_t                       id;
+  int                            ret;
+  int                            i;
+
+  if (count % X8H7_FLT_MSG_SIZE) {
+    DBG_ERROR("invalid filter table size %zu\n", count);
+    return -EINVAL;
+  }
+  n = count / X8H7_FLT_MSG_SIZE;
+
+  /* Validate the whole table first, a bad entry programs nothing */
+  for (i = 0; i < n; i++) {
+    memcpy(x8h7_msg.buf, buf + i * X8H7_FLT_MSG_SIZE, X8H7_FLT_MSG_SIZE);
+    if (x8h7_msg.field.id & CAN_EFF_FLAG) {
+      id = x8h7_msg.field.id & ~CAN_EFF_FLAG;
+      if ((x8h7_msg.field.idx >= X8H7_EXT_FLT_MAX) ||
+          (id & ~0x1FFFFFFF) || (x8h7_msg.field.mask & ~0x1FFFFFFF)) {
+        DBG_ERROR("invalid params at %d\n", i);
+        return -EINVAL;
+      }
+    } else {
+      if ((x8h7_msg.field.idx >= X8H7_STD_FLT_MAX) ||
+          (x8h7_msg.field.id & ~0x7FF) || (x8h7_msg.field.mask & ~0x7FF)) {
+        DBG_ERROR("invalid params at %d\n", i);
+        return -EINVAL;
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    memcpy(x8h7_msg.buf, buf + i * X8H7_FLT_MSG_SIZE, X8H7_FLT_MSG_SIZE);
+    ret = x8h7_can_hw_queue_filter(priv, &x8h7_msg);
+    if (ret < 0) {
+      DBG_ERROR("set filter\n");
+      x8h7_pkt_send_now();
+      return (i == 0) ? -EIO : i * X8H7_FLT_MSG_SIZE;
+    }
+    if (x8h7_msg.field.id & CAN_EFF_FLAG) {
+      priv->ext_flt[x8h7_msg.field.idx].can_id   = x8h7_msg.field.id & ~CAN_EFF_FLAG;
+      priv->ext_flt[x8h7_msg.field.idx].can_mask = x8h7_msg.field.mask;
+    } else {
+      priv->std_flt[x8h7_msg.field.idx].can_id   = x8h7_msg.field.id;
+      priv->std_flt[x8h7_msg.field.idx].can_mask = x8h7_msg.field.mask;
+    }
+  }
+  x8h7_pkt_send_now();
+
+  return count;
+}
+
 /**
  * Standard id filter show
  */
@@ -664,6 +1070,8 @@ static DEVICE_ATTR(std_flt, 0644, x8h7_can_sf_show, x8h7_can_sf_store);
 static DEVICE_ATTR(ext_flt, 0644, x8h7_can_ef_show, x8h7_can_ef_store);
 static DEVICE_ATTR(status , 0644, x8h7_can_sts_show, NULL);
 
+static BIN_ATTR(filters, 0644, x8h7_can_flt_read, x8h7_can_flt_write, X8H7_FLT_TBL_SIZE);
+
 static struct attribute *x8h7_can_sysfs_attrs[] = {
   &dev_attr_std_flt.attr,
   &dev_attr_ext_flt.attr,
@@ -672,9 +1080,15 @@ static struct attribute *x8h7_can_sysfs_attrs[] = {
   NULL,
 };
 
+static struct bin_attribute *x8h7_can_sysfs_bin_attrs[] = {
+  &bin_attr_filters,
+  NULL,
+};
+
 static const struct attribute_group x8h7_can_sysfs_attr_group = {
   .name = "x8h7can",
   .attrs = (struct attribute **)x8h7_can_sysfs_attrs,
+  .bin_attrs = x8h7_can_sysfs_bin_attrs,
 };
 
 /**
@@ -694,7 +1108,7 @@ static int x8h7_can_probe(struct platform_device *pdev)
     DBG_PRINT("fdcan_clk = %d", clock_freq);
   }
 
-  net = alloc_candev(sizeof(struct x8h7_can_priv), 1);
+  net = alloc_candev(sizeof(struct x8h7_can_priv), X8H7_TX_FIFO_SIZE);
   if (!net) {
     return -ENOMEM;
   }
@@ -708,13 +1122,20 @@ static int x8h7_can_probe(struct platform_device *pdev)
   priv->can.clock.freq          = clock_freq;
   priv->can.bittiming_const     = &x8h7_can_bittiming_const;
   priv->can.do_set_bittiming    = x8h7_can_hw_do_set_bittiming;
+  priv->can.data_bittiming_const = &x8h7_can_data_bittiming_const;
+  priv->can.do_set_data_bittiming = x8h7_can_hw_do_set_data_bittiming;
   priv->can.do_set_mode         = x8h7_can_do_set_mode;
   priv->can.do_get_berr_counter = x8h7_can_do_get_berr_counter;
   priv->can.ctrlmode_supported  = CAN_CTRLMODE_LOOPBACK      |
                                   CAN_CTRLMODE_LISTENONLY    |
-                                  CAN_CTRLMODE_3_SAMPLES     ;
+                                  CAN_CTRLMODE_3_SAMPLES     |
+                                  CAN_CTRLMODE_FD            ;
   priv->net = net;
 
+  INIT_KFIFO(priv->rx_fifo);
+  spin_lock_init(&priv->tx_lock);
+  netif_napi_add(net, &priv->napi, x8h7_can_poll);
+
   platform_set_drvdata(pdev, priv);
 
   SET_NETDEV_DEV(net, &pdev->dev);
@@ -742,6 +1163,7 @@ static int x8h7_can_probe(struct platform_device *pdev)
 
 failed_register:
   DBG_ERROR("\n");
+  netif_napi_del(&priv->napi);
   free_candev(net);
   return err;
 }
@@ -754,6 +1176,7 @@ static int x8h7_can_remove(struct platform_device *pdev)
   struct net_device    *net = priv->net;
 
   unregister_candev(net);
+  netif_napi_del(&priv->napi);
   free_candev(net);
 
   return 0;
@@ -12,6 +12,8 @@
 #include <linux/timer.h>
 #include <linux/can/dev.h>
 #include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/netdevice.h>
 
 /**
  * DEFINES
@@ -22,8 +24,11 @@
 #define X8H7_CAN_OC_INIT    0x10
 #define X8H7_CAN_OC_DEINIT  0x11
 #define X8H7_CAN_OC_BITTIM  0x12
+#define X8H7_CAN_OC_DBITTIM 0x13
 #define X8H7_CAN_OC_SEND    0x01
 #define X8H7_CAN_OC_RECV    0x01
+#define X8H7_CAN_OC_SEND_FD 0x02
+#define X8H7_CAN_OC_RECV_FD 0x02
 #define X8H7_CAN_OC_STS     0x40
 #define X8H7_CAN_OC_FLT     0x50
 
@@ -42,13 +47,27 @@
 #define X8H7_CAN_STS_FLG_EWARN   0x40  // Error Warning
 #define X8H7_CAN_STS_FLG_TX_OVR  0x80  // Transmit Buffer Overflow
 
+/* Status sub packet: intf, eflag and, from newer firmware, TEC and REC */
+#define X8H7_CAN_STS_SIZE        2
+#define X8H7_CAN_STS_CNT_SIZE    4
+
 #define X8H7_CAN_HEADER_SIZE        5
 #define X8H7_CAN_FRAME_MAX_DATA_LEN 8
 
+#define X8H7_CANFD_HEADER_SIZE        6
+#define X8H7_CANFD_FRAME_MAX_DATA_LEN 64
+
+/* CAN FD frame flags, same values as canfd_frame flags */
+#define X8H7_CANFD_FLG_BRS  0x01  // Bit Rate Switch
+#define X8H7_CANFD_FLG_ESI  0x02  // Error State Indicator
+#define X8H7_CANFD_FLG_FDF  0x04  // FD Frame, classic frame if clear
+
 #define X8H7_STD_FLT_MAX  128
 #define X8H7_EXT_FLT_MAX   64
 
 #define X8H7_TX_FIFO_SIZE  32
+/* Received frames waiting for NAPI poll, must be a power of 2 */
+#define X8H7_RX_FIFO_SIZE  64
 
 /**
  * TYPEDEFS
@@ -99,22 +118,50 @@ union x8h7_can_frame_message
   uint8_t buf[X8H7_CAN_HEADER_SIZE + X8H7_CAN_FRAME_MAX_DATA_LEN];
 };
 
+/* Frame layout of X8H7_CAN_OC_SEND_FD and X8H7_CAN_OC_RECV_FD */
+union x8h7_canfd_frame_message
+{
+  struct __attribute__((packed))
+  {
+    uint32_t id;
+    uint8_t  len;
+    uint8_t  flags;
+    uint8_t  data[X8H7_CANFD_FRAME_MAX_DATA_LEN];
+  } field;
+  uint8_t buf[X8H7_CANFD_HEADER_SIZE + X8H7_CANFD_FRAME_MAX_DATA_LEN];
+};
+
 struct x8h7_can_priv {
   struct can_priv           can;
   struct net_device        *net;
   struct device            *dev;
   int                       periph;
 
-  int                       tx_len;
-
   struct workqueue_struct     *wq;
   struct work_struct           work;
-  union x8h7_can_frame_message tx_frame;
+
+  /* Tx ring, slot i holds the frame of echo skb i:
+   * tail..send are on the H7 waiting completion, send..head not sent yet.
+   * Indexes are free running, taken modulo X8H7_TX_FIFO_SIZE.
+   * Classic and FD frames share the FD layout, told apart by FDF flag.
+   */
+  union x8h7_canfd_frame_message tx_ring[X8H7_TX_FIFO_SIZE];
+  unsigned int              tx_head;
+  unsigned int              tx_send;
+  unsigned int              tx_tail;
+  spinlock_t                tx_lock;
+
+  /* Last error counters pushed by the H7 */
+  struct can_berr_counter   bec;
 
   struct can_filter         std_flt[X8H7_STD_FLT_MAX];
   struct can_filter         ext_flt[X8H7_EXT_FLT_MAX];
 
   struct mutex              lock;
+
+  /* Filled by the hook, emptied by NAPI poll: single producer and consumer */
+  struct napi_struct        napi;
+  DECLARE_KFIFO(rx_fifo, union x8h7_canfd_frame_message, X8H7_RX_FIFO_SIZE);
 };
 
 #endif
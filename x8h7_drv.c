@@ -32,10 +32,28 @@
 #include <linux/list.h>
 #include <linux/errno.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/compat.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/gpio/consumer.h>
+#include <linux/moduleparam.h>
+#include <linux/uio.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/crc-itu-t.h>
+#include <linux/average.h>
+#include <linux/sched.h>
 
 #include <linux/spi/spi.h>
 #include <linux/spi/spidev.h>
@@ -44,21 +62,131 @@
 
 #include "x8h7.h"
 
+#define CREATE_TRACE_POINTS
+#include "x8h7_trace.h"
+
 #define DRIVER_NAME     "x8h7"
 
 //#define DEBUG
 #include "debug.h"
 
 
+/* Tx frames, one is filled while the other is on the wire */
+#define X8H7_TX_BUF_NUM   2
+/* Max completions waiting on a single frame */
+#define X8H7_TX_DONE_MAX  32
+/* Time an abandoned request still absorbs its late reply */
+#define X8H7_REQ_STALE    (HZ)
+/* Max time a transfer waits for the H7 to release flow control */
+#define X8H7_FLOW_TIMEOUT (HZ/100)
+/* Header size flag, set by the H7 when it has more data queued */
+#define X8H7_HDR_MORE     0x8000
+#define X8H7_HDR_SIZE_MSK 0x7FFF
+/* Link integrity, enabled by "spi-crc": frames kept for retransmission */
+#define X8H7_CRC_SLOTS    2
+#define X8H7_CRC_RETRIES  3
+#define X8H7_CRC_INIT     0xFFFF
+
+/* Latency histogram buckets, bucket n counts [2^(n-1), 2^n) us */
+#define X8H7_HIST_NUM     16
+/* Peripheral ids, one per entry of the dispatch table */
+#define X8H7_STATS_PERIPH X8H7_PERIPH_NUM
+
+struct x8h7_periph_stats {
+  u64  tx_pkts;
+  u64  tx_bytes;
+  u64  rx_pkts;
+  u64  rx_bytes;
+  u64  rtt_hist[X8H7_HIST_NUM];  /* request to reply */
+};
+
+/* Link statistics, per CPU so the hot paths never share a cache line */
+struct x8h7_stats {
+  u64  frames;
+  u64  tx_fill;        /* payload bytes sent */
+  u64  rx_fill;        /* payload bytes received */
+  u64  clocked;        /* bytes clocked on the wire */
+  u64  tx_subpkts;
+  u64  rx_subpkts;
+  u64  hdr_errors;     /* invalid header checksum */
+  u64  parse_errors;
+  u64  crc_errors;     /* frames dropped for a bad CRC */
+  u64  seq_drops;      /* duplicated or out of order frames dropped */
+  u64  retransmits;
+  u64  retx_failed;    /* frames given up after X8H7_CRC_RETRIES */
+  u64  lock_wait_ns;
+  u64  suppressed;     /* empty transfers skipped by the link policy */
+  u64  lock_hist[X8H7_HIST_NUM];
+  u64  irq_hist[X8H7_HIST_NUM];  /* H7 interrupt to frame parsed */
+  struct x8h7_periph_stats periph[X8H7_STATS_PERIPH];
+};
+
+static unsigned int irq_budget = 8;
+module_param(irq_budget, uint, 0644);
+MODULE_PARM_DESC(irq_budget, "Max frames transferred per H7 interrupt");
+
+/* Frame fill in percent, averaged over about 8 frames */
+DECLARE_EWMA(x8h7_fill, 4, 8)
+
+static const char * const x8h7_link_policy_names[] = {
+  [X8H7_LINK_PERFORMANCE] = "performance",
+  [X8H7_LINK_POWERSAVE]   = "powersave",
+  [X8H7_LINK_LOWLATENCY]  = "lowlatency",
+};
+
 struct spidev_data {
   struct spi_device  *spi;
-  struct mutex        lock;
-  u32                 speed_hz;
-  u8                 *x8h7_txb;
+  struct mutex        lock;     /* serializes SPI transfers */
+  spinlock_t          tx_lock;  /* protects the frame being filled */
+  u32                 speed_hz; /* current, follows the link policy */
+  u32                 max_speed_hz;
+  u32                 min_speed_hz;
+  enum x8h7_link_policy policy;
+  struct ewma_x8h7_fill fill;
+  u8                 *x8h7_txb; /* frame being filled */
   u16                 x8h7_txl;
+  u8                 *x8h7_txq[X8H7_TX_BUF_NUM];
+  int                 tx_idx;
+  u32                 tx_seq;   /* sequence of the frame being filled */
+  u32                 tx_sent;  /* sequence of the last frame sent */
+  struct completion  *tx_done[X8H7_TX_BUF_NUM][X8H7_TX_DONE_MAX];
+  int                 tx_ndone[X8H7_TX_BUF_NUM];
+  /* Async pipeline, transfers and parsing run in a dedicated kthread */
+  struct kthread_worker *kworker;
+  struct kthread_work    pump;
+  /* Requests waiting for a reply, in submission order */
+  spinlock_t          req_lock;
+  struct list_head    req_list;
   u8                 *x8h7_rxb;
   u16                 fixed_length;
+  u16                 buf_size;
+  bool                variable_length;
+  /* Flow control, asserted by the H7 while it can't accept a frame */
   struct gpio_desc   *flow_ctrl_gpio;
+  int                 flow_ctrl_irq;
+  wait_queue_head_t   flow_wait;
+  u64                 flow_stalls;
+  u64                 flow_timeouts;
+  u64                 flow_stall_ns;
+  u64                 flow_stall_ns_max;
+  /* H7 has more data queued after the last frame */
+  bool                rx_more;
+  bool                irq_level;  /* irq line level can be read */
+  ktime_t             irq_ts;     /* H7 interrupt not yet served */
+  /* CRC trailer and retransmission, trl_size is 0 when disabled */
+  u16                 trl_size;
+  u8                  crc_tx_seq;   /* last sequence we sent */
+  u8                  crc_rx_seq;   /* last H7 sequence accepted, our ack */
+  u32                 xfer_cnt;
+  struct {
+    u8               *buf;
+    u8                seq;
+    bool              pending;      /* not acknowledged by the H7 yet */
+    int               tries;
+    u32               sent_in;      /* xfer_cnt of its last transfer */
+  } crc_slot[X8H7_CRC_SLOTS];
+  struct x8h7_stats __percpu *stats;
+  struct dentry      *debugfs;
 };
 
 /*-------------------------------------------------------------------------*/
@@ -72,6 +200,18 @@ typedef struct __attribute__((packed, aligned(4))) {
   uint16_t      checksum;
 } x8h7_pkthdr_t;
 
+/**
+ * Trailer following the payload when "spi-crc" is set, both ways.
+ * seq numbers frames with payload (0 on empty ones), ack is the last
+ * sequence accepted from the other side, crc is CRC-16/CCITT
+ * (poly 0x1021, init 0xFFFF) of header, payload, seq and ack.
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t   seq;
+  uint8_t   ack;
+  uint16_t  crc;
+} x8h7_pkttrl_t;
+
 /**
  */
 typedef struct __attribute__((packed, aligned(4))) {
@@ -80,17 +220,28 @@ typedef struct __attribute__((packed, aligned(4))) {
   uint16_t  size;
 } x8h7_subpkt_t;
 
-#define X8H7_PERIPH_NUM   16
-x8h7_hook_t x8h7_hook[X8H7_PERIPH_NUM] = {};
-void *x8h7_hook_priv[X8H7_PERIPH_NUM];
+/* Dispatch table entry, replaced as a whole so hook and priv always match */
+struct x8h7_hook_entry {
+  x8h7_hook_t  hook;
+  void        *priv;
+};
+
+/* Read under RCU by pkt_parse, updated under x8h7_hook_lock */
+static struct x8h7_hook_entry __rcu *x8h7_hook[X8H7_PERIPH_NUM];
+static DEFINE_MUTEX(x8h7_hook_lock);
+
+/* Copy of every sub packet of the peripherals in mask, same rules as hooks */
+struct x8h7_tap_entry {
+  u32          mask;
+  x8h7_tap_t   hook;
+  void        *priv;
+};
+
+static struct x8h7_tap_entry __rcu *x8h7_tap;
 
 void (*x8h7_dbg)(void*, uint8_t*, uint16_t);
 void *x8h7_dbg_priv;
 
-/**
- */
-#if defined(DEBUG)
-
 #define X8H7_PERIPH_ADC     0x01
 #define X8H7_PERIPH_PWM     0x02
 #define X8H7_PERIPH_FDCAN1  0x03
@@ -100,10 +251,11 @@ void *x8h7_dbg_priv;
 #define X8H7_PERIPH_GPIO    0x07
 #define X8H7_PERIPH_H7      0x09
 #define X8H7_PERIPH_UI      0x0A
+#define X8H7_PERIPH_ECHO    0x0B
 
 /**
  */
-char* to_peripheral_string(uint8_t peripheral) {
+static const char *to_peripheral_string(uint8_t peripheral) {
   switch (peripheral) {
   case X8H7_PERIPH_H7    : return "H7";
   case X8H7_PERIPH_ADC   : return "ADC";
@@ -114,10 +266,15 @@ char* to_peripheral_string(uint8_t peripheral) {
   case X8H7_PERIPH_RTC   : return "RTC";
   case X8H7_PERIPH_GPIO  : return "GPIO";
   case X8H7_PERIPH_UI    : return "UI";
+  case X8H7_PERIPH_ECHO  : return "ECHO";
   default                : return "UNKNOWN";
   }
 }
 
+/**
+ */
+#if defined(DEBUG)
+
 /**
  */
 void pkt_dump(char *title, void *data)
@@ -168,61 +325,190 @@ void pkt_dump(char *title, void *data) {}
 #endif
 
 /**
+ * Account a latency in a log2 microseconds histogram
  */
-int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
+static void x8h7_hist_add(u64 __percpu *hist, u64 ns)
+{
+  u64  us = div_u64(ns, NSEC_PER_USEC);
+  int  n = us ? min(ilog2(us) + 1, X8H7_HIST_NUM - 1) : 0;
+
+  this_cpu_inc(hist[n]);
+}
+
+/**
+ * Take the transfer lock, accounting the time spent waiting for it
+ */
+static void x8h7_lock(struct spidev_data *spidev)
+{
+  ktime_t  start = ktime_get();
+  u64      ns;
+
+  mutex_lock(&spidev->lock);
+  ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  this_cpu_add(spidev->stats->lock_wait_ns, ns);
+  x8h7_hist_add(spidev->stats->lock_hist, ns);
+}
+
+/**
+ * Append a sub packet to the frame being filled.
+ * Must be called with tx_lock held.
+ */
+static int __x8h7_pkt_enq_v(struct spidev_data *spidev,
+                            uint8_t peripheral, uint8_t opcode,
+                            const struct kvec *iov, int cnt)
 {
-  struct spidev_data *spidev = x8h7_spidev;
   x8h7_pkthdr_t      *hdr;
   x8h7_subpkt_t      *pkt;
   uint8_t            *ptr;
+  size_t              size;
+  int                 i;
+
+  size = 0;
+  for (i = 0; i < cnt; i++) {
+    size += iov[i].iov_len;
+  }
+  if (size > U16_MAX) {
+    return -EINVAL;
+  }
 
   ptr = spidev->x8h7_txb;
   hdr = (x8h7_pkthdr_t*)ptr;
 
-  if ((hdr->size + sizeof(x8h7_subpkt_t) + size) < X8H7_BUF_SIZE) {
+  if ((sizeof(x8h7_pkthdr_t) + hdr->size +
+       sizeof(x8h7_subpkt_t) + size) <= spidev->buf_size - spidev->trl_size) {
     ptr += sizeof(x8h7_pkthdr_t) + hdr->size;
     pkt = (x8h7_subpkt_t*)ptr;
     pkt->peripheral = peripheral;
     pkt->opcode     = opcode;
     pkt->size       = size;
     ptr += sizeof(x8h7_subpkt_t);
-    if (size) {
-      if (!data) {
-        memset(ptr, 0, size);
+    /* Spans are copied straight in the frame, a NULL one is zero filled */
+    for (i = 0; i < cnt; i++) {
+      if (!iov[i].iov_len) {
+        continue;
+      }
+      if (!iov[i].iov_base) {
+        memset(ptr, 0, iov[i].iov_len);
       } else {
-        memcpy(ptr, data, size);
+        memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
       }
+      ptr += iov[i].iov_len;
     }
     hdr->size += sizeof(x8h7_subpkt_t) + size;
     hdr->checksum = hdr->size ^ 0x5555;
     spidev->x8h7_txl = hdr->size;
+    if (peripheral < X8H7_STATS_PERIPH) {
+      this_cpu_inc(spidev->stats->periph[peripheral].tx_pkts);
+      this_cpu_add(spidev->stats->periph[peripheral].tx_bytes, size);
+    }
+    this_cpu_inc(spidev->stats->tx_subpkts);
+    trace_x8h7_pkt_enq(peripheral, opcode, size, hdr->size);
     return 0;
   }
 
   return -ENOMEM;
 }
 
+static int __x8h7_pkt_enq(struct spidev_data *spidev,
+                          uint8_t peripheral, uint8_t opcode,
+                          uint16_t size, void *data)
+{
+  struct kvec iov = {
+    .iov_base = data,
+    .iov_len  = size,
+  };
+
+  return __x8h7_pkt_enq_v(spidev, peripheral, opcode, &iov, 1);
+}
+
+/**
+ * Enqueue a sub packet, seq returns the sequence of the frame carrying it.
+ * Only tx_lock is taken, so this never waits for a transfer in flight.
+ */
+static int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size,
+                        void *data, u32 *seq)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  unsigned long       flags;
+  int                 ret;
+
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  ret = __x8h7_pkt_enq(spidev, peripheral, opcode, size, data);
+  if (seq) {
+    *seq = spidev->tx_seq;
+  }
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+
+  return ret;
+}
+
+/**
+ * Enqueue a sub packet and register done to be completed
+ * once the frame carrying it has been transferred and parsed.
+ */
+static int x8h7_pkt_enq_done(uint8_t peripheral, uint8_t opcode, uint16_t size,
+                             void *data, struct completion *done)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  unsigned long       flags;
+  int                 idx;
+  int                 ret;
+
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  idx = spidev->tx_idx;
+  if (done && spidev->tx_ndone[idx] >= X8H7_TX_DONE_MAX) {
+    ret = -ENOMEM;
+  } else {
+    ret = __x8h7_pkt_enq(spidev, peripheral, opcode, size, data);
+    if (!ret && done) {
+      spidev->tx_done[idx][spidev->tx_ndone[idx]++] = done;
+    }
+  }
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+
+  return ret;
+}
+
+/**
+ * True once the frame with sequence seq has been transferred.
+ * Must be called with lock held.
+ */
+static bool x8h7_pkt_sent(struct spidev_data *spidev, u32 seq)
+{
+  return (s32)(spidev->tx_sent - seq) >= 0;
+}
+
 static int x8h7_pkt_send(void);
+static bool x8h7_irq_pending(struct spidev_data *spidev);
 /**
  */
 int x8h7_pkt_send_sync(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
 {
   struct spidev_data *spidev = x8h7_spidev;
+  u32 seq;
   int ret;
 
-  mutex_lock(&spidev->lock);
-  ret = x8h7_pkt_enq(peripheral, opcode, size, data);
-  if (ret < 0) {
-    printk("x8h7_pkt_enq failed with %d", ret);
+  ret = x8h7_pkt_enq(peripheral, opcode, size, data, &seq);
+  if (ret == -ENOMEM) {
+    /* Frame is full, flush it and retry on the next one */
+    x8h7_lock(spidev);
+    x8h7_pkt_send();
     mutex_unlock(&spidev->lock);
-    return ret;
+    ret = x8h7_pkt_enq(peripheral, opcode, size, data, &seq);
   }
-  ret = x8h7_pkt_send();
   if (ret < 0) {
-    printk("x8h7_pkt_send failed with %d", ret);
-    mutex_unlock(&spidev->lock);
+    printk("x8h7_pkt_enq failed with %d", ret);
     return ret;
   }
+
+  x8h7_lock(spidev);
+  /* A transfer started meanwhile may have carried our packet already */
+  if (!x8h7_pkt_sent(spidev, seq)) {
+    ret = x8h7_pkt_send();
+    if (ret < 0) {
+      printk("x8h7_pkt_send failed with %d", ret);
+    }
+  }
   mutex_unlock(&spidev->lock);
 
   return ret;
@@ -233,19 +519,110 @@ EXPORT_SYMBOL_GPL(x8h7_pkt_send_sync);
  */
 int x8h7_pkt_send_defer(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
 {
-  struct spidev_data *spidev = x8h7_spidev;
   int ret;
 
-  mutex_lock(&spidev->lock);
-  ret = x8h7_pkt_enq(peripheral, opcode, size, data);
-  if (ret < 0) {
+  ret = x8h7_pkt_enq(peripheral, opcode, size, data, NULL);
+  /* A full frame is left to the caller, it may flush and retry */
+  if ((ret < 0) && (ret != -ENOMEM)) {
     printk("x8h7_pkt_enq failed with %d", ret);
   }
-  mutex_unlock(&spidev->lock);
   return ret;
 }
 EXPORT_SYMBOL_GPL(x8h7_pkt_send_defer);
 
+/**
+ * Enqueue a single sub packet whose payload is gathered from iov,
+ * e.g. the two spans of a circular buffer, with no intermediate copy.
+ * Like x8h7_pkt_send_defer it returns -ENOMEM when the frame is full.
+ */
+int x8h7_pkt_send_defer_v(uint8_t peripheral, uint8_t opcode,
+                          const struct kvec *iov, int cnt)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  unsigned long       flags;
+  int                 ret;
+
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  ret = __x8h7_pkt_enq_v(spidev, peripheral, opcode, iov, cnt);
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+
+  if ((ret < 0) && (ret != -ENOMEM)) {
+    printk("x8h7_pkt_enq failed with %d", ret);
+  }
+  return ret;
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_defer_v);
+
+/**
+ * Payload room left for one more sub packet in the frame being filled.
+ * Only a hint: other producers may take it before the caller enqueues.
+ */
+uint16_t x8h7_pkt_room(void)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  x8h7_pkthdr_t      *hdr;
+  unsigned long       flags;
+  int                 room;
+
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  hdr = (x8h7_pkthdr_t*)spidev->x8h7_txb;
+  room = spidev->buf_size - spidev->trl_size - sizeof(x8h7_pkthdr_t) -
+         hdr->size - sizeof(x8h7_subpkt_t);
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+
+  return (room > 0) ? room : 0;
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_room);
+
+/**
+ * True when a transfer would clock an empty frame for nothing: nothing
+ * queued, the H7 has nothing pending and no frame awaits its ack.
+ * Only trusted outside the performance policy, which keeps polling.
+ * Must be called with lock held.
+ */
+static bool x8h7_pkt_idle(struct spidev_data *spidev)
+{
+  unsigned long  flags;
+  u16            txl;
+  int            i;
+
+  if (spidev->policy == X8H7_LINK_PERFORMANCE) {
+    return false;
+  }
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  txl = spidev->x8h7_txl;
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+  if (txl || spidev->rx_more || !spidev->irq_level ||
+      x8h7_irq_pending(spidev)) {
+    return false;
+  }
+  for (i = 0; i < X8H7_CRC_SLOTS; i++) {
+    if (spidev->crc_slot[i].pending) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Adapt the clock to the load, powersave only: from min_speed_hz on an
+ * idle link up to max_speed_hz when frames are full.
+ * Must be called with lock held.
+ */
+static void x8h7_link_adapt(struct spidev_data *spidev, u16 tx_size, u16 rx_size)
+{
+  unsigned int  room = spidev->buf_size - sizeof(x8h7_pkthdr_t) - spidev->trl_size;
+  unsigned long pct;
+
+  if ((spidev->policy != X8H7_LINK_POWERSAVE) || !spidev->max_speed_hz) {
+    return;
+  }
+  ewma_x8h7_fill_add(&spidev->fill, max(tx_size, rx_size) * 100 / room);
+  pct = min_t(unsigned long, ewma_x8h7_fill_read(&spidev->fill), 100);
+  spidev->speed_hz = spidev->min_speed_hz +
+                     (spidev->max_speed_hz - spidev->min_speed_hz) / 100 * pct;
+}
+
 /**
  */
 int x8h7_pkt_send_now(void)
@@ -253,7 +630,12 @@ int x8h7_pkt_send_now(void)
   struct spidev_data *spidev = x8h7_spidev;
   int ret;
 
-  mutex_lock(&spidev->lock);
+  x8h7_lock(spidev);
+  if (x8h7_pkt_idle(spidev)) {
+    this_cpu_inc(spidev->stats->suppressed);
+    mutex_unlock(&spidev->lock);
+    return 0;
+  }
   ret = x8h7_pkt_send();
   if (ret < 0) {
     printk("x8h7_pkt_send failed with %d", ret);
@@ -263,6 +645,221 @@ int x8h7_pkt_send_now(void)
 }
 EXPORT_SYMBOL_GPL(x8h7_pkt_send_now);
 
+/**
+ * Pump work: keep sending frames, one spi_sync at a time, while
+ * producers fill them, then go idle.
+ */
+static void x8h7_pkt_pump(struct kthread_work *work)
+{
+  struct spidev_data *spidev = container_of(work, struct spidev_data, pump);
+  unsigned long       flags;
+  u16                 txl;
+
+  x8h7_lock(spidev);
+  for (;;) {
+    spin_lock_irqsave(&spidev->tx_lock, flags);
+    txl = spidev->x8h7_txl;
+    spin_unlock_irqrestore(&spidev->tx_lock, flags);
+    if (!txl) {
+      break;
+    }
+    x8h7_pkt_send();
+  }
+  mutex_unlock(&spidev->lock);
+}
+
+/**
+ * Fire and forget send: the packet is enqueued and the transfer is run
+ * by the SPI kthread, the caller doesn't sleep and may be atomic.
+ * If done is not NULL it is completed once the frame carrying the packet
+ * has been transferred and the received data dispatched.
+ */
+int x8h7_pkt_send_async(uint8_t peripheral, uint8_t opcode, uint16_t size,
+                        void *data, struct completion *done)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  int ret;
+
+  ret = x8h7_pkt_enq_done(peripheral, opcode, size, data, done);
+  /* Kick the pump even when full, so the frame gets flushed */
+  kthread_queue_work(spidev->kworker, &spidev->pump);
+  if (ret < 0) {
+    DBG_ERROR("x8h7_pkt_enq failed with %d", ret);
+  }
+  return ret;
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_async);
+
+/**
+ * Request/response correlation.
+ * A request is matched by the first reply with the same peripheral and
+ * opcode, requests are queued in submission order as the H7 answers in
+ * order. A request whose waiter gave up stays queued for a while, so a
+ * late reply is absorbed by it instead of being taken by a newer one.
+ */
+struct x8h7_req {
+  struct list_head    list;
+  uint8_t             peripheral;
+  uint8_t             opcode;
+  bool                abandoned;
+  unsigned long       expires;
+  ktime_t             start;
+  struct completion   done;
+  x8h7_pkt_t          rsp;
+};
+
+/**
+ * Free abandoned requests whose reply never came.
+ * Must be called with req_lock held.
+ */
+static void x8h7_req_reap(struct spidev_data *spidev)
+{
+  struct x8h7_req *req, *tmp;
+
+  list_for_each_entry_safe(req, tmp, &spidev->req_list, list) {
+    if (req->abandoned && time_after(jiffies, req->expires)) {
+      list_del(&req->list);
+      kfree(req);
+    }
+  }
+}
+
+/**
+ * Enqueue a request, its reply is collected with x8h7_req_wait.
+ * The request is deferred: several of them may be submitted and
+ * then flushed in a single frame with x8h7_pkt_send_now.
+ */
+struct x8h7_req *x8h7_req_submit(uint8_t peripheral, uint8_t opcode,
+                                 uint16_t size, void *data)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  struct x8h7_req    *req;
+  unsigned long       flags;
+  int                 ret;
+
+  req = kzalloc(sizeof(*req), GFP_KERNEL);
+  if (!req) {
+    return ERR_PTR(-ENOMEM);
+  }
+  req->peripheral = peripheral;
+  req->opcode     = opcode;
+  req->start      = ktime_get();
+  init_completion(&req->done);
+
+  /* Queue it before the packet leaves, the reply can't come earlier */
+  spin_lock_irqsave(&spidev->req_lock, flags);
+  x8h7_req_reap(spidev);
+  list_add_tail(&req->list, &spidev->req_list);
+  spin_unlock_irqrestore(&spidev->req_lock, flags);
+
+  ret = x8h7_pkt_enq(peripheral, opcode, size, data, NULL);
+  if (ret == -ENOMEM) {
+    /* Frame is full, flush it and retry on the next one */
+    x8h7_pkt_send_now();
+    ret = x8h7_pkt_enq(peripheral, opcode, size, data, NULL);
+  }
+  if (ret < 0) {
+    printk("x8h7_pkt_enq failed with %d", ret);
+    spin_lock_irqsave(&spidev->req_lock, flags);
+    list_del(&req->list);
+    spin_unlock_irqrestore(&spidev->req_lock, flags);
+    kfree(req);
+    return ERR_PTR(ret);
+  }
+
+  return req;
+}
+EXPORT_SYMBOL_GPL(x8h7_req_submit);
+
+/**
+ * Wait for the reply of req and release it.
+ * On success the reply is copied to rsp, if not NULL.
+ */
+int x8h7_req_wait(struct x8h7_req *req, x8h7_pkt_t *rsp, long timeout)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  unsigned long       flags;
+  long                ret;
+
+  ret = wait_for_completion_interruptible_timeout(&req->done, timeout);
+
+  spin_lock_irqsave(&spidev->req_lock, flags);
+  if (!list_empty(&req->list)) {
+    /* No reply yet, leave it queued to absorb a late one */
+    req->abandoned = true;
+    req->expires = jiffies + X8H7_REQ_STALE;
+    spin_unlock_irqrestore(&spidev->req_lock, flags);
+    DBG_ERROR("timeout expired");
+    return ret < 0 ? ret : -ETIMEDOUT;
+  }
+  spin_unlock_irqrestore(&spidev->req_lock, flags);
+
+  if (rsp) {
+    memcpy(rsp, &req->rsp, sizeof(x8h7_pkt_t));
+  }
+  kfree(req);
+  return 0;
+}
+EXPORT_SYMBOL_GPL(x8h7_req_wait);
+
+/**
+ * Send a request and wait for its reply
+ */
+int x8h7_pkt_send_recv(uint8_t peripheral, uint8_t opcode, uint16_t size,
+                       void *data, x8h7_pkt_t *rsp)
+{
+  struct x8h7_req *req;
+
+  req = x8h7_req_submit(peripheral, opcode, size, data);
+  if (IS_ERR(req)) {
+    return PTR_ERR(req);
+  }
+  x8h7_pkt_send_now();
+  return x8h7_req_wait(req, rsp, X8H7_RX_TIMEOUT);
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_recv);
+
+/**
+ * Hand a received sub packet to the oldest matching request.
+ * Returns true if the sub packet has been consumed.
+ */
+static bool x8h7_req_match(struct spidev_data *spidev, x8h7_subpkt_t *pkt,
+                           uint8_t *data)
+{
+  struct x8h7_req *req;
+  unsigned long    flags;
+  bool             found = false;
+
+  spin_lock_irqsave(&spidev->req_lock, flags);
+  list_for_each_entry(req, &spidev->req_list, list) {
+    if ((req->peripheral == pkt->peripheral) &&
+        (req->opcode == pkt->opcode)) {
+      found = true;
+      break;
+    }
+  }
+  if (found) {
+    list_del_init(&req->list);
+    if (pkt->peripheral < X8H7_STATS_PERIPH) {
+      x8h7_hist_add(spidev->stats->periph[pkt->peripheral].rtt_hist,
+                    ktime_to_ns(ktime_sub(ktime_get(), req->start)));
+    }
+    if (req->abandoned) {
+      kfree(req);
+    } else {
+      req->rsp.peripheral = pkt->peripheral;
+      req->rsp.opcode     = pkt->opcode;
+      req->rsp.size       = min_t(uint16_t, pkt->size, X8H7_PKT_SIZE);
+      memcpy(req->rsp.data, data, req->rsp.size);
+      /* Under req_lock, the waiter may free req as soon as it's unlocked */
+      complete(&req->done);
+    }
+  }
+  spin_unlock_irqrestore(&spidev->req_lock, flags);
+
+  return found;
+}
+
 /**
  * Function to parse data coming from h7
  * and dispatch to peripheral
@@ -280,40 +877,77 @@ static int pkt_parse(struct spidev_data *spidev)
   ptr = spidev->x8h7_rxb;
   hdr = (x8h7_pkthdr_t*)ptr;
   size = hdr->size;
+  if (size > spidev->buf_size - sizeof(x8h7_pkthdr_t)) {
+    DBG_ERROR("frame size is %d\n", size);
+    size = spidev->buf_size - sizeof(x8h7_pkthdr_t);
+  }
   ptr += sizeof(x8h7_pkthdr_t);
 
+  this_cpu_add(spidev->stats->rx_fill, size);
+  if (spidev->irq_ts) {
+    x8h7_hist_add(spidev->stats->irq_hist,
+                  ktime_to_ns(ktime_sub(ktime_get(), spidev->irq_ts)));
+    spidev->irq_ts = 0;
+  }
+
   /* Loop to parse data from h7 and dispatch to correct peripheral */
-  do {
+  while (size >= sizeof(x8h7_subpkt_t)) {
     pkt = (x8h7_subpkt_t*)ptr;
     ptr += sizeof(x8h7_subpkt_t);
+    size -= sizeof(x8h7_subpkt_t);
+
+    if (pkt->size > size) {
+      DBG_ERROR("packet size %d exceeds frame\n", pkt->size);
+      this_cpu_inc(spidev->stats->parse_errors);
+      return -EINVAL;
+    }
 
     i = pkt->peripheral;
     if (i < X8H7_PERIPH_NUM) {
       if (pkt->peripheral == 0 || pkt->size == 0) {
         return 0;
       }
-      if (x8h7_hook[i]) {
-        x8h7_pkt_t p;
-        p.peripheral = pkt->peripheral;
-        p.opcode     = pkt->opcode;
-        p.size       = pkt->size;
-        if (p.size > X8H7_PKT_SIZE) {
-          DBG_ERROR("packet size is %d\n", pkt->size);
-          p.size = X8H7_PKT_SIZE;
+      this_cpu_inc(spidev->stats->rx_subpkts);
+      this_cpu_inc(spidev->stats->periph[i].rx_pkts);
+      this_cpu_add(spidev->stats->periph[i].rx_bytes, pkt->size);
+      if (rcu_access_pointer(x8h7_tap)) {
+        struct x8h7_tap_entry *t;
+
+        rcu_read_lock();
+        t = rcu_dereference(x8h7_tap);
+        if (t && (t->mask & BIT(i))) {
+          t->hook(t->priv, pkt->peripheral, pkt->opcode, ptr, pkt->size);
         }
-        memcpy(p.data, ptr, p.size);
-        x8h7_hook[i](x8h7_hook_priv[i], &p);
+        rcu_read_unlock();
+      }
+      if (x8h7_req_match(spidev, pkt, ptr)) {
+        /* Reply to a pending request */
+        trace_x8h7_pkt_dispatch(pkt->peripheral, pkt->opcode, pkt->size, true);
+      } else {
+        struct x8h7_hook_entry *e;
+
+        trace_x8h7_pkt_dispatch(pkt->peripheral, pkt->opcode, pkt->size, false);
+        /* Hooks get the payload in place, valid until they return */
+        rcu_read_lock();
+        e = rcu_dereference(x8h7_hook[i]);
+        if (e) {
+          e->hook(e->priv, pkt->opcode, ptr, pkt->size);
+        }
+        rcu_read_unlock();
       }
     }
 
     ptr += pkt->size;
-    size -= (sizeof(x8h7_subpkt_t) + pkt->size);
-  } while (size > 0);
+    size -= pkt->size;
+  }
 
   return 0;
 }
 
 /**
+ * Synchronous transfer, only ever run by the SPI kthread or a sync
+ * sender: spi_sync may run it in the caller's context.
+ * Must be called with lock held.
  */
 int x8h7_spi_trx(struct spi_device *spi,
                  void *tx_buf, void* rx_buf, unsigned len)
@@ -330,7 +964,9 @@ int x8h7_spi_trx(struct spi_device *spi,
   spi_message_init(&m);
   spi_message_add_tail(&t, &m);
 
+  trace_x8h7_spi_trx_start(len);
   ret = spi_sync(spi, &m);
+  trace_x8h7_spi_trx_end(len, ret);
   if (ret) {
     DBG_ERROR("spi transfer failed: ret = %d\n", ret);
   }
@@ -359,56 +995,459 @@ int x8h7_spi_trx(struct spi_device *spi,
 }
 
 /**
- * Function to send/receive physically data over SPI,
- * moreover in this function we process received data
- * and dispatch to corresponding peripheral
+ * Variable length transfer, enabled by "spi-variable-length" property.
+ * The first chip select cycle clocks our header and payload only, while
+ * the H7 header and the beginning of its payload are received.
+ * If the H7 has more payload than we sent, a second chip select cycle
+ * clocks just the missing bytes. Both sides know the two sizes after
+ * the first cycle, so the second one needs no further handshake.
+ * A bad H7 header, already counted, fails with -EBADMSG.
  */
-static int x8h7_pkt_send(void)
+static int x8h7_spi_trx_var(struct spidev_data *spidev, u8 *txb)
 {
-  struct spidev_data   *spidev = x8h7_spidev;
-  x8h7_pkthdr_t        *hdr;
-  int                   len;
+  x8h7_pkthdr_t  *hdr;
+  unsigned        len;
+  unsigned        rx_len;
+  int             ret;
+
+  hdr = (x8h7_pkthdr_t*)txb;
+  len = sizeof(x8h7_pkthdr_t) + hdr->size + spidev->trl_size;
+  ret = x8h7_spi_trx(spidev->spi,
+                     txb,
+                     spidev->x8h7_rxb, len);
+  this_cpu_add(spidev->stats->clocked, len);
+  if (ret) {
+    return ret;
+  }
 
-  DBG_PRINT("\n");
+  hdr = (x8h7_pkthdr_t*)spidev->x8h7_rxb;
+  if (hdr->size == 0) {
+    return 0;
+  }
+  if ((hdr->size ^ 0x5555) != hdr->checksum) {
+    DBG_ERROR("invalid header size %04X checksum %04X\n",
+              hdr->size, hdr->checksum);
+    this_cpu_inc(spidev->stats->hdr_errors);
+    return -EBADMSG;
+  }
 
-  len = FIXED_PACKET_LEN;
+  rx_len = sizeof(x8h7_pkthdr_t) + (hdr->size & X8H7_HDR_SIZE_MSK) +
+           spidev->trl_size;
+  if (rx_len > spidev->buf_size) {
+    DBG_ERROR("header size %d exceeds buffer\n", hdr->size);
+    rx_len = spidev->buf_size;
+  }
+  if (rx_len > len) {
+    /* Tx buffer is zero beyond our payload */
+    ret = x8h7_spi_trx(spidev->spi,
+                       txb + len,
+                       spidev->x8h7_rxb + len, rx_len - len);
+    this_cpu_add(spidev->stats->clocked, rx_len - len);
+  }
+
+  return ret;
+}
 
-  pkt_dump("Send", spidev->x8h7_txb);
+/**
+ * Flow control interrupt, wake up the transfer waiting for the H7
+ */
+static irqreturn_t x8h7_flow_isr(int irq, void *data)
+{
+  struct spidev_data  *spidev = (struct spidev_data*)data;
 
-  x8h7_spi_trx(spidev->spi,
-               spidev->x8h7_txb,
-               spidev->x8h7_rxb, len);
+  wake_up(&spidev->flow_wait);
+  return IRQ_HANDLED;
+}
+
+static bool x8h7_flow_busy(struct spidev_data *spidev)
+{
+  return gpiod_get_value_cansleep(spidev->flow_ctrl_gpio) > 0;
+}
+
+/* Used as wait condition, the irq path is taken for non sleeping gpios only */
+static bool x8h7_flow_busy_atomic(struct spidev_data *spidev)
+{
+  return gpiod_get_value(spidev->flow_ctrl_gpio) > 0;
+}
+
+/**
+ * Wait for the H7 to be ready before clocking a frame.
+ * The line is waited on its edge interrupt, or polled if the gpio
+ * has none. On timeout the frame is sent anyway, the H7 may have
+ * missed releasing the line and we must not stall forever.
+ * Must be called with lock held.
+ */
+static void x8h7_flow_wait(struct spidev_data *spidev)
+{
+  unsigned long   deadline;
+  ktime_t         start;
+  u64             ns;
+  bool            busy;
+
+  if (!spidev->flow_ctrl_gpio || !x8h7_flow_busy(spidev)) {
+    return;
+  }
+
+  start = ktime_get();
+  if (spidev->flow_ctrl_irq > 0) {
+    busy = !wait_event_timeout(spidev->flow_wait,
+                               !x8h7_flow_busy_atomic(spidev),
+                               X8H7_FLOW_TIMEOUT);
+  } else {
+    deadline = jiffies + X8H7_FLOW_TIMEOUT;
+    do {
+      usleep_range(20, 50);
+      busy = x8h7_flow_busy(spidev);
+    } while (busy && time_before(jiffies, deadline));
+  }
+  ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+  spidev->flow_stalls++;
+  spidev->flow_stall_ns += ns;
+  if (ns > spidev->flow_stall_ns_max) {
+    spidev->flow_stall_ns_max = ns;
+  }
+  if (busy) {
+    spidev->flow_timeouts++;
+    DBG_ERROR("flow control timeout\n");
+  }
+}
+
+static void x8h7_pkt_xfer(struct spidev_data *spidev, u8 *txb);
+
+/**
+ * Sequence numbers run 1..255, 0 marks a frame with no payload
+ */
+static u8 x8h7_seq_next(u8 seq)
+{
+  return (seq % 255) + 1;
+}
+
+/* True if seq is ack or precedes it */
+static bool x8h7_seq_acked(u8 seq, u8 ack)
+{
+  return ack && (((ack - 1) - (seq - 1) + 255) % 255) < 128;
+}
+
+static void x8h7_crc_trailer(struct spidev_data *spidev, u8 *buf, u8 seq)
+{
+  x8h7_pkthdr_t  *hdr = (x8h7_pkthdr_t*)buf;
+  x8h7_pkttrl_t  *trl;
+  unsigned        len = sizeof(x8h7_pkthdr_t) + hdr->size;
+
+  trl = (x8h7_pkttrl_t*)(buf + len);
+  trl->seq = seq;
+  trl->ack = spidev->crc_rx_seq;
+  trl->crc = crc_itu_t(X8H7_CRC_INIT, buf, len + offsetof(x8h7_pkttrl_t, crc));
+}
+
+/**
+ * Number the frame about to be sent and keep a copy of it until the
+ * H7 acknowledges it. Must be called with lock held.
+ */
+static void x8h7_crc_seal(struct spidev_data *spidev, u8 *txb)
+{
+  x8h7_pkthdr_t  *hdr = (x8h7_pkthdr_t*)txb;
+  int             i;
+  int             n = 0;
+  u8              seq = 0;
 
-  hdr = (x8h7_pkthdr_t*)spidev->x8h7_rxb;
-  // @TODO: Add control
   if (hdr->size) {
+    /* A free slot, or else the oldest one */
+    for (i = 0; i < X8H7_CRC_SLOTS; i++) {
+      if (!spidev->crc_slot[i].pending) {
+        n = i;
+        break;
+      }
+      if (spidev->crc_slot[i].sent_in < spidev->crc_slot[n].sent_in) {
+        n = i;
+      }
+    }
+    if (spidev->crc_slot[n].pending) {
+      /* Can't happen after x8h7_crc_retransmit, drop the oldest */
+      this_cpu_inc(spidev->stats->retx_failed);
+    }
+    seq = spidev->crc_tx_seq = x8h7_seq_next(spidev->crc_tx_seq);
+  }
+  x8h7_crc_trailer(spidev, txb, seq);
+
+  if (seq) {
+    memcpy(spidev->crc_slot[n].buf, txb, spidev->buf_size);
+    spidev->crc_slot[n].seq = seq;
+    spidev->crc_slot[n].pending = true;
+    spidev->crc_slot[n].tries = 0;
+    spidev->crc_slot[n].sent_in = spidev->xfer_cnt + 1;
+  }
+}
+
+/**
+ * Validate the received frame: CRC, then acknowledged frames are
+ * released and the sequence is checked. Frames are accepted in order
+ * only, the H7 resends what we don't acknowledge.
+ * Returns true if the payload can be parsed.
+ */
+static bool x8h7_crc_check(struct spidev_data *spidev)
+{
+  x8h7_pkthdr_t  *hdr = (x8h7_pkthdr_t*)spidev->x8h7_rxb;
+  x8h7_pkttrl_t  *trl;
+  unsigned        len;
+  int             i;
+
+  len = sizeof(x8h7_pkthdr_t) + (hdr->size & X8H7_HDR_SIZE_MSK);
+  if (len + spidev->trl_size > spidev->buf_size) {
+    this_cpu_inc(spidev->stats->crc_errors);
+    return false;
+  }
+  trl = (x8h7_pkttrl_t*)(spidev->x8h7_rxb + len);
+  if (crc_itu_t(X8H7_CRC_INIT, spidev->x8h7_rxb,
+                len + offsetof(x8h7_pkttrl_t, crc)) != trl->crc) {
+    DBG_ERROR("invalid frame crc %04X\n", trl->crc);
+    this_cpu_inc(spidev->stats->crc_errors);
+    return false;
+  }
+
+  for (i = 0; i < X8H7_CRC_SLOTS; i++) {
+    if (spidev->crc_slot[i].pending &&
+        x8h7_seq_acked(spidev->crc_slot[i].seq, trl->ack)) {
+      spidev->crc_slot[i].pending = false;
+    }
+  }
+
+  if (trl->seq == 0) {
+    return true;
+  }
+  if (trl->seq != x8h7_seq_next(spidev->crc_rx_seq)) {
+    DBG_ERROR("unexpected frame seq %d after %d\n", trl->seq, spidev->crc_rx_seq);
+    this_cpu_inc(spidev->stats->seq_drops);
+    return false;
+  }
+  spidev->crc_rx_seq = trl->seq;
+  return true;
+}
+
+/**
+ * Resend, oldest first, the frames the H7 didn't acknowledge.
+ * The frame of the last transfer can't be acknowledged yet: the H7
+ * answers while receiving it, so that one is checked on the next.
+ * Must be called with lock held.
+ */
+static void x8h7_crc_retransmit(struct spidev_data *spidev)
+{
+  int  n;
+  int  i;
+
+  for (;;) {
+    n = -1;
+    for (i = 0; i < X8H7_CRC_SLOTS; i++) {
+      if (spidev->crc_slot[i].pending &&
+          (spidev->crc_slot[i].sent_in < spidev->xfer_cnt) &&
+          ((n < 0) || (spidev->crc_slot[i].sent_in < spidev->crc_slot[n].sent_in))) {
+        n = i;
+      }
+    }
+    if (n < 0) {
+      break;
+    }
+    if (++spidev->crc_slot[n].tries > X8H7_CRC_RETRIES) {
+      DBG_ERROR("frame seq %d lost\n", spidev->crc_slot[n].seq);
+      this_cpu_inc(spidev->stats->retx_failed);
+      spidev->crc_slot[n].pending = false;
+      continue;
+    }
+    this_cpu_inc(spidev->stats->retransmits);
+    /* Refresh our ack, it may have moved since the first time */
+    x8h7_crc_trailer(spidev, spidev->crc_slot[n].buf, spidev->crc_slot[n].seq);
+    spidev->crc_slot[n].sent_in = spidev->xfer_cnt + 1;
+    x8h7_pkt_xfer(spidev, spidev->crc_slot[n].buf);
+  }
+}
+
+/**
+ * Clock one frame and dispatch what the H7 sent back.
+ * Frames failing the header checksum or the CRC are dropped.
+ * Must be called with lock held.
+ */
+static void x8h7_pkt_xfer(struct spidev_data *spidev, u8 *txb)
+{
+  x8h7_pkthdr_t  *hdr;
+  bool            valid;
+  int             len;
+  int             ret;
+
+  spidev->xfer_cnt++;
+  this_cpu_inc(spidev->stats->frames);
+  this_cpu_add(spidev->stats->tx_fill, ((x8h7_pkthdr_t*)txb)->size);
+
+  x8h7_flow_wait(spidev);
+
+  if (spidev->variable_length) {
+    ret = x8h7_spi_trx_var(spidev, txb);
+  } else {
+    len = spidev->buf_size;
+    ret = x8h7_spi_trx(spidev->spi,
+                       txb,
+                       spidev->x8h7_rxb, len);
+    this_cpu_add(spidev->stats->clocked, len);
+  }
+
+  hdr = (x8h7_pkthdr_t*)spidev->x8h7_rxb;
+  if (ret) {
+    /* Failed transfer or bad header, nothing in the rx buffer is trusted */
+    valid = false;
+  } else {
+    valid = !hdr->size || ((hdr->size ^ 0x5555) == hdr->checksum);
+    if (!valid) {
+      DBG_ERROR("invalid header size %04X checksum %04X\n",
+                hdr->size, hdr->checksum);
+      this_cpu_inc(spidev->stats->hdr_errors);
+    }
+  }
+  if (valid && spidev->trl_size) {
+    valid = x8h7_crc_check(spidev);
+  }
+  spidev->rx_more = !!(hdr->size & X8H7_HDR_MORE);
+  hdr->size &= X8H7_HDR_SIZE_MSK;
+  x8h7_link_adapt(spidev, ((x8h7_pkthdr_t*)txb)->size, valid ? hdr->size : 0);
+  if (!valid) {
+    /* Go on transferring, the H7 resends what we didn't acknowledge */
+    spidev->rx_more = spidev->trl_size != 0;
+  } else if (hdr->size) {
     if (x8h7_dbg) {
-      x8h7_dbg(x8h7_dbg_priv, spidev->x8h7_rxb, hdr->size);
+      /* Whole frame, header included */
+      x8h7_dbg(x8h7_dbg_priv, spidev->x8h7_rxb,
+               sizeof(x8h7_pkthdr_t) + hdr->size);
     } else {
       pkt_parse(spidev);
     }
   }
 
-  memset(spidev->x8h7_txb, 0, X8H7_BUF_SIZE);
-  memset(spidev->x8h7_rxb, 0, X8H7_BUF_SIZE);
+  memset(spidev->x8h7_rxb, 0, spidev->buf_size);
+}
+
+/**
+ * Function to send/receive physically data over SPI,
+ * moreover in this function we process received data
+ * and dispatch to corresponding peripheral.
+ * Must be called with lock held: the frame being filled is swapped
+ * with the spare one under tx_lock, so producers keep enqueuing
+ * to the next frame while this one is on the wire.
+ */
+static int x8h7_pkt_send(void)
+{
+  struct spidev_data   *spidev = x8h7_spidev;
+  unsigned long         flags;
+  u8                   *txb;
+  int                   idx;
+  int                   i;
+
+  DBG_PRINT("\n");
+
+  spin_lock_irqsave(&spidev->tx_lock, flags);
+  txb = spidev->x8h7_txb;
+  idx = spidev->tx_idx;
+  spidev->tx_idx = (spidev->tx_idx + 1) % X8H7_TX_BUF_NUM;
+  spidev->x8h7_txb = spidev->x8h7_txq[spidev->tx_idx];
   spidev->x8h7_txl = 0;
+  spidev->tx_sent = spidev->tx_seq++;
+  spin_unlock_irqrestore(&spidev->tx_lock, flags);
+
+  pkt_dump("Send", txb);
+
+  if (spidev->trl_size) {
+    x8h7_crc_seal(spidev, txb);
+  }
+  x8h7_pkt_xfer(spidev, txb);
+  if (spidev->trl_size) {
+    x8h7_crc_retransmit(spidev);
+  }
+
+  /* The spare frame is swapped in again only under lock */
+  memset(txb, 0, spidev->buf_size);
+
+  for (i = 0; i < spidev->tx_ndone[idx]; i++) {
+    complete(spidev->tx_done[idx][i]);
+  }
+  spidev->tx_ndone[idx] = 0;
 
   return 0;
 }
 
 /**
+ * Install or, with a NULL hook, remove the receive hook of a peripheral.
+ * Safe while traffic is flowing: once it returns the previous hook is
+ * not running and won't be called again. Must not be called from a hook.
+ * A peripheral has a single owner: installing a hook with another priv
+ * over an existing one fails with -EBUSY.
  */
 int x8h7_hook_set(uint8_t idx, x8h7_hook_t hook, void *priv)
 {
+  struct x8h7_hook_entry *e = NULL;
+  struct x8h7_hook_entry *old;
+
   if (idx >= X8H7_PERIPH_NUM) {
-    return -1;
+    return -EINVAL;
+  }
+  if (hook) {
+    e = kmalloc(sizeof(*e), GFP_KERNEL);
+    if (!e) {
+      return -ENOMEM;
+    }
+    e->hook = hook;
+    e->priv = priv;
+  }
+
+  mutex_lock(&x8h7_hook_lock);
+  old = rcu_dereference_protected(x8h7_hook[idx],
+                                  lockdep_is_held(&x8h7_hook_lock));
+  if (e && old && (old->priv != priv)) {
+    mutex_unlock(&x8h7_hook_lock);
+    kfree(e);
+    return -EBUSY;
+  }
+  rcu_assign_pointer(x8h7_hook[idx], e);
+  mutex_unlock(&x8h7_hook_lock);
+
+  if (old) {
+    synchronize_rcu();
+    kfree(old);
   }
-  x8h7_hook[idx] = hook;
-  x8h7_hook_priv[idx] = priv;
   return 0;
 }
 EXPORT_SYMBOL_GPL(x8h7_hook_set);
 
+/**
+ * Install a tap seeing the RX sub packets of the peripherals in mask,
+ * bit n for peripheral n, on top of the normal reply and hook dispatch.
+ * A single tap at a time, mask 0 or a NULL hook removes it.
+ * Same rules as x8h7_hook_set.
+ */
+int x8h7_tap_set(u32 mask, x8h7_tap_t hook, void *priv)
+{
+  struct x8h7_tap_entry *t = NULL;
+  struct x8h7_tap_entry *old;
+
+  if (hook && mask) {
+    t = kmalloc(sizeof(*t), GFP_KERNEL);
+    if (!t) {
+      return -ENOMEM;
+    }
+    t->mask = mask;
+    t->hook = hook;
+    t->priv = priv;
+  }
+
+  mutex_lock(&x8h7_hook_lock);
+  old = rcu_replace_pointer(x8h7_tap, t, lockdep_is_held(&x8h7_hook_lock));
+  mutex_unlock(&x8h7_hook_lock);
+
+  if (old) {
+    synchronize_rcu();
+    kfree(old);
+  }
+  return 0;
+}
+EXPORT_SYMBOL_GPL(x8h7_tap_set);
+
 /**
  */
 int x8h7_dbg_set(void (*hook)(void*, uint8_t*, uint16_t), void *priv)
@@ -419,26 +1458,269 @@ int x8h7_dbg_set(void (*hook)(void*, uint8_t*, uint16_t), void *priv)
 }
 EXPORT_SYMBOL_GPL(x8h7_dbg_set);
 
+/**
+ * Select the link policy:
+ * - performance, the DT clock and every requested transfer, as before
+ * - powersave, clock following the frame fill and no empty transfers
+ * - lowlatency, DT clock, no empty transfers and the SPI kthread at
+ *   SCHED_FIFO like the threaded ISR, so async sends and CAN traffic
+ *   are not delayed by normal tasks
+ */
+int x8h7_link_policy_set(enum x8h7_link_policy policy)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+
+  if ((policy < 0) || (policy >= X8H7_LINK_POLICY_NUM)) {
+    return -EINVAL;
+  }
+
+  x8h7_lock(spidev);
+  spidev->policy = policy;
+  spidev->speed_hz = spidev->max_speed_hz;
+  ewma_x8h7_fill_init(&spidev->fill);
+  mutex_unlock(&spidev->lock);
+
+  if (policy == X8H7_LINK_LOWLATENCY) {
+    sched_set_fifo(spidev->kworker->task);
+  } else {
+    sched_set_normal(spidev->kworker->task, 0);
+  }
+  DBG_PRINT("link policy %s\n", x8h7_link_policy_names[policy]);
+  return 0;
+}
+EXPORT_SYMBOL_GPL(x8h7_link_policy_set);
+
+/**
+ */
+enum x8h7_link_policy x8h7_link_policy_get(void)
+{
+  return READ_ONCE(x8h7_spidev->policy);
+}
+EXPORT_SYMBOL_GPL(x8h7_link_policy_get);
+
+/**
+ * True if the H7 still holds the interrupt line asserted, it's active low
+ */
+static bool x8h7_irq_pending(struct spidev_data *spidev)
+{
+  bool  state;
+
+  if (!spidev->irq_level) {
+    return false;
+  }
+  if (irq_get_irqchip_state(spidev->spi->irq, IRQCHIP_STATE_LINE_LEVEL, &state)) {
+    return false;
+  }
+  return !state;
+}
+
+/**
+ * Hard interrupt, only timestamps the H7 request for the statistics
+ */
+static irqreturn_t x8h7_isr(int irq, void *data)
+{
+  struct spidev_data  *spidev = (struct spidev_data*)data;
+
+  if (!spidev->irq_ts) {
+    spidev->irq_ts = ktime_get();
+  }
+  return IRQ_WAKE_THREAD;
+}
+
 /**
  * Interrupt handler
+ * Keep transferring while the H7 reports more data, either with the
+ * header flag or holding the line, up to irq_budget frames. The lock
+ * is released between frames so that other senders are not starved.
  */
 static irqreturn_t x8h7_threaded_isr(int irq, void *data)
 {
   struct spidev_data  *spidev = (struct spidev_data*)data;
+  unsigned int         budget = max(irq_budget, 1U);
+  bool                 more;
 
-  mutex_lock(&spidev->lock);
   DBG_PRINT("Got IRQ from H7\n");
-  x8h7_pkt_send();
-  mutex_unlock(&spidev->lock);
+  trace_x8h7_irq(irq);
+  do {
+    x8h7_lock(spidev);
+    x8h7_pkt_send();
+    more = spidev->rx_more;
+    mutex_unlock(&spidev->lock);
+  } while (--budget && (more || x8h7_irq_pending(spidev)));
 
   return IRQ_HANDLED;
 }
 
+static ssize_t x8h7_flow_ctrl_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+  struct spidev_data  *spidev = spi_get_drvdata(to_spi_device(dev));
+  int                  len;
+
+  mutex_lock(&spidev->lock);
+  len = sysfs_emit(buf, "enabled %d\n"
+                        "irq %d\n"
+                        "stalls %llu\n"
+                        "timeouts %llu\n"
+                        "stall_ns %llu\n"
+                        "stall_ns_max %llu\n",
+                   spidev->flow_ctrl_gpio != NULL,
+                   spidev->flow_ctrl_irq,
+                   spidev->flow_stalls,
+                   spidev->flow_timeouts,
+                   spidev->flow_stall_ns,
+                   spidev->flow_stall_ns_max);
+  mutex_unlock(&spidev->lock);
+  return len;
+}
+
+static DEVICE_ATTR(flow_ctrl, 0444, x8h7_flow_ctrl_show, NULL);
+
+static ssize_t link_policy_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+  struct spidev_data  *spidev = spi_get_drvdata(to_spi_device(dev));
+  int                  len = 0;
+  int                  i;
+
+  for (i = 0; i < X8H7_LINK_POLICY_NUM; i++) {
+    len += sysfs_emit_at(buf, len, (i == spidev->policy) ? "[%s] " : "%s ",
+                         x8h7_link_policy_names[i]);
+  }
+  len += sysfs_emit_at(buf, len, "\nspeed_hz %u\n", READ_ONCE(spidev->speed_hz));
+  return len;
+}
+
+static ssize_t link_policy_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+  int  ret;
+
+  ret = sysfs_match_string(x8h7_link_policy_names, buf);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = x8h7_link_policy_set(ret);
+  return ret ? ret : count;
+}
+
+static DEVICE_ATTR_RW(link_policy);
+
+static struct attribute *x8h7_sysfs_attrs[] = {
+  &dev_attr_flow_ctrl.attr,
+  &dev_attr_link_policy.attr,
+  NULL,
+};
+
+static const struct attribute_group x8h7_sysfs_attr_group = {
+  .name = "x8h7",
+  .attrs = x8h7_sysfs_attrs,
+};
+
+/**
+ * Sum the per CPU statistics
+ */
+static void x8h7_stats_get(struct spidev_data *spidev, struct x8h7_stats *sum)
+{
+  const u64  *src;
+  u64        *dst = (u64 *)sum;
+  int         cpu;
+  int         i;
+
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu) {
+    src = (const u64 *)per_cpu_ptr(spidev->stats, cpu);
+    for (i = 0; i < sizeof(*sum) / sizeof(u64); i++) {
+      dst[i] += src[i];
+    }
+  }
+}
+
+static void x8h7_hist_show(struct seq_file *s, const char *name, const u64 *hist)
+{
+  int  i;
+
+  seq_printf(s, "%s", name);
+  for (i = 0; i < X8H7_HIST_NUM; i++) {
+    seq_printf(s, " %llu", hist[i]);
+  }
+  seq_puts(s, "\n");
+}
+
+static int x8h7_stats_show(struct seq_file *s, void *unused)
+{
+  struct spidev_data        *spidev = s->private;
+  struct x8h7_stats         *st;
+  struct x8h7_periph_stats  *p;
+  u64                        fill;
+  int                        i;
+
+  st = kmalloc(sizeof(*st), GFP_KERNEL);
+  if (!st) {
+    return -ENOMEM;
+  }
+  x8h7_stats_get(spidev, st);
+
+  /* Fill is payload over clocked bytes, both directions share the wire */
+  fill = max(st->tx_fill, st->rx_fill);
+  seq_printf(s, "frames %llu\n"
+                "tx_fill %llu\n"
+                "rx_fill %llu\n"
+                "clocked %llu\n"
+                "fill_pct %llu\n"
+                "tx_subpkts %llu\n"
+                "rx_subpkts %llu\n"
+                "hdr_errors %llu\n"
+                "parse_errors %llu\n"
+                "crc_errors %llu\n"
+                "seq_drops %llu\n"
+                "retransmits %llu\n"
+                "retx_failed %llu\n"
+                "lock_wait_ns %llu\n"
+                "suppressed %llu\n",
+             st->frames, st->tx_fill, st->rx_fill, st->clocked,
+             st->clocked ? div64_u64(fill * 100, st->clocked) : 0,
+             st->tx_subpkts, st->rx_subpkts,
+             st->hdr_errors, st->parse_errors,
+             st->crc_errors, st->seq_drops, st->retransmits, st->retx_failed,
+             st->lock_wait_ns, st->suppressed);
+
+  seq_printf(s, "# histograms, bucket n counts [2^(n-1), 2^n) us\n");
+  x8h7_hist_show(s, "lock_wait", st->lock_hist);
+  x8h7_hist_show(s, "irq_to_parse", st->irq_hist);
+
+  seq_printf(s, "# periph tx_pkts tx_bytes rx_pkts rx_bytes\n");
+  for (i = 0; i < X8H7_STATS_PERIPH; i++) {
+    p = &st->periph[i];
+    if (!p->tx_pkts && !p->rx_pkts) {
+      continue;
+    }
+    seq_printf(s, "%02X %s %llu %llu %llu %llu\n", i, to_peripheral_string(i),
+               p->tx_pkts, p->tx_bytes, p->rx_pkts, p->rx_bytes);
+  }
+  for (i = 0; i < X8H7_STATS_PERIPH; i++) {
+    char  name[16];
+
+    p = &st->periph[i];
+    if (!p->tx_pkts && !p->rx_pkts) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "rtt_%02X", i);
+    x8h7_hist_show(s, name, p->rtt_hist);
+  }
+
+  kfree(st);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(x8h7_stats);
+
 static int x8h7_probe(struct spi_device *spi)
 {
   struct spidev_data  *spidev;
   int                  status;
   uint32_t             value;
+  int                  i;
 
   /* Allocate driver data */
   spidev = kzalloc(sizeof(*spidev), GFP_KERNEL);
@@ -448,72 +1730,163 @@ static int x8h7_probe(struct spi_device *spi)
   /* Initialize the driver data */
   spidev->spi = spi;
   mutex_init(&spidev->lock);
+  spin_lock_init(&spidev->tx_lock);
+  kthread_init_work(&spidev->pump, x8h7_pkt_pump);
+  spin_lock_init(&spidev->req_lock);
+  INIT_LIST_HEAD(&spidev->req_list);
+
+  spidev->stats = devm_alloc_percpu(&spi->dev, struct x8h7_stats);
+  if (!spidev->stats) {
+    kfree(spidev);
+    return -ENOMEM;
+  }
 
   /* Device speed */
   if (!of_property_read_u32(spi->dev.of_node, "spi-max-frequency", &value))
     spidev->speed_hz = value;
   DBG_PRINT("Configuring speed_hz=%d\n", spidev->speed_hz);
+  spidev->max_speed_hz = spidev->speed_hz ? spidev->speed_hz : spi->max_speed_hz;
+  /* Powersave floor, slow enough to matter and still fast for one frame */
+  spidev->min_speed_hz = spidev->max_speed_hz / 8;
+  spidev->policy = X8H7_LINK_PERFORMANCE;
+  ewma_x8h7_fill_init(&spidev->fill);
 
   /* Fixed length */
   if (!of_property_read_u32(spi->dev.of_node, "spi-fixed-length", &value))
     spidev->fixed_length = value;
   DBG_PRINT("Configuring length=%d\n", spidev->fixed_length);
 
+  /* Frame length, it must hold at least one full sub packet */
+  spidev->buf_size = X8H7_BUF_SIZE;
+  if (spidev->fixed_length) {
+    if ((spidev->fixed_length < X8H7_BUF_SIZE) ||
+        (spidev->fixed_length > X8H7_BUF_SIZE_MAX) ||
+        (spidev->fixed_length % 4)) {
+      dev_warn(&spi->dev, "invalid spi-fixed-length %d, using %d\n",
+               spidev->fixed_length, X8H7_BUF_SIZE);
+    } else {
+      spidev->buf_size = spidev->fixed_length;
+    }
+  }
+
+  /* Variable length, clock only the bytes announced by the headers */
+  spidev->variable_length = of_property_read_bool(spi->dev.of_node,
+                                                  "spi-variable-length");
+  DBG_PRINT("Configuring variable length=%d\n", spidev->variable_length);
+
+  /* CRC trailer, a full sub packet must still fit the frame */
+  if (of_property_read_bool(spi->dev.of_node, "spi-crc")) {
+    if (spidev->buf_size < X8H7_BUF_SIZE + sizeof(x8h7_pkttrl_t)) {
+      dev_warn(&spi->dev, "spi-crc needs spi-fixed-length of at least %zu, disabled\n",
+               X8H7_BUF_SIZE + sizeof(x8h7_pkttrl_t));
+    } else {
+      spidev->trl_size = sizeof(x8h7_pkttrl_t);
+    }
+  }
+  DBG_PRINT("Configuring crc=%d\n", spidev->trl_size != 0);
+
   status = 0;
 
-  if (status == 0) {
-    spidev->x8h7_txb = devm_kzalloc(&spi->dev, X8H7_BUF_SIZE, GFP_KERNEL);
-    if (!spidev->x8h7_txb) {
+  for (i = 0; i < X8H7_TX_BUF_NUM; i++) {
+    spidev->x8h7_txq[i] = devm_kzalloc(&spi->dev, spidev->buf_size, GFP_KERNEL);
+    if (!spidev->x8h7_txq[i]) {
       DBG_ERROR("X8H7 Tx buffer memory fail\n");
-      status = -ENOMEM;
+      kfree(spidev);
+      return -ENOMEM;
     }
   }
+  spidev->tx_idx = 0;
+  spidev->x8h7_txb = spidev->x8h7_txq[0];
+  spidev->tx_seq = 0;
+  spidev->tx_sent = spidev->tx_seq - 1;
+
+  spidev->x8h7_rxb = devm_kzalloc(&spi->dev, spidev->buf_size, GFP_KERNEL);
+  if (!spidev->x8h7_rxb) {
+    DBG_ERROR("X8H7 Rx buffer memory fail\n");
+    kfree(spidev);
+    return -ENOMEM;
+  }
 
-  if (status == 0) {
-    spidev->x8h7_rxb = devm_kzalloc(&spi->dev, X8H7_BUF_SIZE, GFP_KERNEL);
-    if (!spidev->x8h7_rxb) {
-      DBG_ERROR("X8H7 Rx buffer memory fail\n");
-      status = -ENOMEM;
+  for (i = 0; spidev->trl_size && (i < X8H7_CRC_SLOTS); i++) {
+    spidev->crc_slot[i].buf = devm_kzalloc(&spi->dev, spidev->buf_size, GFP_KERNEL);
+    if (!spidev->crc_slot[i].buf) {
+      DBG_ERROR("X8H7 retransmission buffer memory fail\n");
+      kfree(spidev);
+      return -ENOMEM;
     }
   }
-
-  memset(spidev->x8h7_txb, 0, X8H7_BUF_SIZE);
-  memset(spidev->x8h7_rxb, 0, X8H7_BUF_SIZE);
   spidev->x8h7_txl = 0;
 
+  spidev->kworker = kthread_create_worker(0, "x8h7_spi");
+  if (IS_ERR(spidev->kworker)) {
+    DBG_ERROR("Cannot create SPI kthread\n");
+    status = PTR_ERR(spidev->kworker);
+    kfree(spidev);
+    return status;
+  }
+
   /* Request optional flow control pin, in case it's a list the first */
+  init_waitqueue_head(&spidev->flow_wait);
+  spidev->flow_ctrl_irq = -1;
   spidev->flow_ctrl_gpio = devm_gpiod_get_optional(&spi->dev, "flow-ctrl", GPIOD_IN);
-  if ((int)spidev->flow_ctrl_gpio < 0) {
+  if (IS_ERR(spidev->flow_ctrl_gpio)) {
     DBG_ERROR("Cannot obtain flow-ctrl-gpio\n");
-    return (int)spidev->flow_ctrl_gpio;
+    status = PTR_ERR(spidev->flow_ctrl_gpio);
+    kthread_destroy_worker(spidev->kworker);
+    kfree(spidev);
+    return status;
   }
 
-  /* Example: read flow control pin */
   if (spidev->flow_ctrl_gpio) {
-    value = gpiod_get_value_cansleep(spidev->flow_ctrl_gpio);
-    DBG_PRINT("Flow control GPIO value: %d\n", value);
+    int irq;
+    irq = gpiod_to_irq(spidev->flow_ctrl_gpio);
+    if ((irq > 0) && !gpiod_cansleep(spidev->flow_ctrl_gpio) &&
+        !devm_request_irq(&spi->dev, irq, x8h7_flow_isr,
+                          IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                          "x8h7_flow", spidev)) {
+      spidev->flow_ctrl_irq = irq;
+    } else {
+      dev_info(&spi->dev, "flow-ctrl-gpio has no irq, polling it\n");
+    }
+    DBG_PRINT("Flow control GPIO value: %d irq %d\n",
+              gpiod_get_value_cansleep(spidev->flow_ctrl_gpio),
+              spidev->flow_ctrl_irq);
   }
 
   /* Configure interrupt request */
   if (spi->irq > 0) {
     int ret;
     ret = devm_request_threaded_irq(&spi->dev, spi->irq,
-                                    NULL, x8h7_threaded_isr,
+                                    x8h7_isr, x8h7_threaded_isr,
                                     IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
                                     "x8h7", spidev);
     if (ret) {
       DBG_ERROR("Failed request IRQ #%d\n", spi->irq);
       status = -ENODEV;
+    } else {
+      bool  state;
+      /* Not every irqchip can report the line level */
+      spidev->irq_level = !irq_get_irqchip_state(spi->irq,
+                                                 IRQCHIP_STATE_LINE_LEVEL,
+                                                 &state);
     }
-    DBG_PRINT("IRQ request irq %d OK\n", spi->irq);
+    DBG_PRINT("IRQ request irq %d OK level %d\n", spi->irq, spidev->irq_level);
   }
 
   x8h7_spidev = spidev;
 
-  if (status == 0)
+  if (status == 0) {
     spi_set_drvdata(spi, spidev);
-  else
+    if (devm_device_add_group(&spi->dev, &x8h7_sysfs_attr_group)) {
+      DBG_ERROR("Cannot create sysfs group\n");
+    }
+    spidev->debugfs = debugfs_create_dir("x8h7", NULL);
+    debugfs_create_file("stats", 0444, spidev->debugfs, spidev,
+                        &x8h7_stats_fops);
+  } else {
+    kthread_destroy_worker(spidev->kworker);
     kfree(spidev);
+  }
 
   return status;
 }
@@ -521,6 +1894,22 @@ static int x8h7_probe(struct spi_device *spi)
 static void x8h7_remove(struct spi_device *spi)
 {
   struct spidev_data	*spidev = spi_get_drvdata(spi);
+  struct x8h7_req     *req, *tmp;
+
+  debugfs_remove_recursive(spidev->debugfs);
+
+  /* Pending async frames are flushed before the worker is gone */
+  kthread_destroy_worker(spidev->kworker);
+
+  if (spidev->flow_ctrl_irq > 0) {
+    devm_free_irq(&spi->dev, spidev->flow_ctrl_irq, spidev);
+  }
+
+  /* Only abandoned requests may be left, sub drivers are gone */
+  list_for_each_entry_safe(req, tmp, &spidev->req_list, list) {
+    list_del(&req->list);
+    kfree(req);
+  }
 
   /* make sure ops on existing fds can abort cleanly */
   kfree(spidev);
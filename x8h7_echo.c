@@ -0,0 +1,374 @@
+/**
+ * X8H7 link loopback and benchmark
+ * The H7 echo peripheral sends ECHO packets back unchanged and drops
+ * SINK ones, so the link can be measured without any peripheral logic.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <asm/unaligned.h>
+
+#include <linux/of_device.h>
+#include <linux/platform_device.h>
+
+#include "x8h7.h"
+#include "x8h7_ioctl.h"
+
+#define DRIVER_NAME "x8h7_echo"
+
+//#define DEBUG
+#include "debug.h"
+
+// Peripheral code
+#define X8H7_ECHO_PERIPH    0x0B
+// Op code
+#define X8H7_ECHO_OC_ECHO   0x01
+#define X8H7_ECHO_OC_SINK   0x02
+
+/* Time allowed for the whole STREAM echo to come back, per packet */
+#define X8H7_ECHO_PKT_TIMEOUT_US  1000
+
+struct x8h7_echo_priv {
+  struct device      *dev;
+  dev_t               dev_num;
+  struct cdev         cdev;
+  struct class       *cl;
+
+  struct mutex        lock;     /* one benchmark at a time */
+  wait_queue_head_t   wait;
+  /* STREAM replies of run gen, counted by the hook under rx_lock */
+  spinlock_t          rx_lock;
+  u32                 gen;
+  u32                 rx_pkts;
+  u64                 rx_bytes;
+  u32                 rx_errors;
+  u32                 size;
+};
+
+struct x8h7_echo_priv *x8h7_echo;
+
+/**
+ * Payload: run generation, sequence, then a pattern of both.
+ * The generation tells late echoes of a previous run apart.
+ */
+static void x8h7_echo_fill(uint8_t *data, u32 size, u32 gen, u32 seq)
+{
+  u32  i;
+
+  put_unaligned_le32(gen, data);
+  put_unaligned_le32(seq, data + 4);
+  for (i = 8; i < size; i++) {
+    data[i] = gen + seq + i;
+  }
+}
+
+/**
+ * Echoes not taken by a request, i.e. the STREAM ones
+ */
+static void x8h7_echo_hook(void *prv, uint8_t opcode, const uint8_t *data,
+                           uint16_t size)
+{
+  struct x8h7_echo_priv  *priv = (struct x8h7_echo_priv*)prv;
+  uint8_t                 ref[X8H7_ECHO_SIZE_MAX];
+  unsigned long           flags;
+  bool                    bad;
+
+  if (opcode != X8H7_ECHO_OC_ECHO) {
+    return;
+  }
+
+  spin_lock_irqsave(&priv->rx_lock, flags);
+  if ((size >= 8) && (get_unaligned_le32(data) != priv->gen)) {
+    /* Late echo of a previous run */
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    return;
+  }
+  bad = (size != priv->size) || (size < 8);
+  if (!bad) {
+    x8h7_echo_fill(ref, size, priv->gen, get_unaligned_le32(data + 4));
+    bad = memcmp(ref, data, size) != 0;
+  }
+  priv->rx_errors += bad;
+  priv->rx_bytes += size;
+  WRITE_ONCE(priv->rx_pkts, priv->rx_pkts + 1);
+  spin_unlock_irqrestore(&priv->rx_lock, flags);
+
+  wake_up(&priv->wait);
+}
+
+static int x8h7_echo_rtt(struct x8h7_echo_priv *priv, struct x8h7_echo_bench *b,
+                         u32 gen, u32 *lat)
+{
+  uint8_t      data[X8H7_ECHO_SIZE_MAX];
+  x8h7_pkt_t   rsp;
+  ktime_t      start;
+  u32          i;
+  int          ret;
+
+  for (i = 0; i < b->count; i++) {
+    x8h7_echo_fill(data, b->size, gen, i);
+    start = ktime_get();
+    ret = x8h7_pkt_send_recv(X8H7_ECHO_PERIPH, X8H7_ECHO_OC_ECHO, b->size, data, &rsp);
+    if (lat) {
+      lat[i] = min_t(s64, ktime_to_ns(ktime_sub(ktime_get(), start)), U32_MAX);
+    }
+    if (ret == -ERESTARTSYS) {
+      return ret;
+    }
+    b->tx_bytes += b->size;
+    if (ret < 0) {
+      b->errors++;
+      continue;
+    }
+    b->rx_bytes += rsp.size;
+    if ((rsp.size != b->size) || memcmp(rsp.data, data, b->size)) {
+      b->errors++;
+    }
+  }
+  return 0;
+}
+
+static int x8h7_echo_defer(struct x8h7_echo_bench *b, u32 gen, uint8_t opcode)
+{
+  uint8_t  data[X8H7_ECHO_SIZE_MAX];
+  u32      i;
+  int      ret;
+
+  for (i = 0; i < b->count; i++) {
+    x8h7_echo_fill(data, b->size, gen, i);
+    ret = x8h7_pkt_send_defer(X8H7_ECHO_PERIPH, opcode, b->size, data);
+    if (ret == -ENOMEM) {
+      x8h7_pkt_send_now();
+      ret = x8h7_pkt_send_defer(X8H7_ECHO_PERIPH, opcode, b->size, data);
+    }
+    if (ret < 0) {
+      return ret;
+    }
+    b->tx_bytes += b->size;
+    if (b->batch && ((i + 1) % b->batch == 0)) {
+      x8h7_pkt_send_now();
+    }
+  }
+  x8h7_pkt_send_now();
+  return 0;
+}
+
+static long x8h7_echo_bench_run(struct x8h7_echo_priv *priv,
+                                struct x8h7_echo_bench __user *ub)
+{
+  struct x8h7_echo_bench  b;
+  u32                    *lat = NULL;
+  unsigned long           flags;
+  u32                     gen;
+  u32                     i;
+  ktime_t                 start;
+  long                    timeout;
+  int                     ret = 0;
+
+  if (copy_from_user(&b, ub, sizeof(b))) {
+    return -EFAULT;
+  }
+  if ((b.mode > X8H7_ECHO_BENCH_STREAM) || !b.count ||
+      (b.count > X8H7_ECHO_COUNT_MAX) ||
+      (b.size < X8H7_ECHO_SIZE_MIN) || (b.size > X8H7_ECHO_SIZE_MAX)) {
+    return -EINVAL;
+  }
+  if (b.lat_ns && (b.mode == X8H7_ECHO_BENCH_RTT)) {
+    lat = kvmalloc_array(b.count, sizeof(*lat), GFP_KERNEL);
+    if (!lat) {
+      return -ENOMEM;
+    }
+  }
+  b.tx_bytes = 0;
+  b.rx_bytes = 0;
+  b.errors = 0;
+
+  if (mutex_lock_interruptible(&priv->lock)) {
+    kvfree(lat);
+    return -ERESTARTSYS;
+  }
+  spin_lock_irqsave(&priv->rx_lock, flags);
+  gen = ++priv->gen;
+  priv->size = b.size;
+  priv->rx_pkts = 0;
+  priv->rx_bytes = 0;
+  priv->rx_errors = 0;
+  spin_unlock_irqrestore(&priv->rx_lock, flags);
+
+  start = ktime_get();
+  switch (b.mode) {
+  case X8H7_ECHO_BENCH_RTT:
+    ret = x8h7_echo_rtt(priv, &b, gen, lat);
+    break;
+  case X8H7_ECHO_BENCH_SYNC:
+    for (i = 0; (i < b.count) && (ret >= 0); i++) {
+      uint8_t  data[X8H7_ECHO_SIZE_MAX];
+
+      x8h7_echo_fill(data, b.size, gen, i);
+      ret = x8h7_pkt_send_sync(X8H7_ECHO_PERIPH, X8H7_ECHO_OC_SINK, b.size, data);
+      b.tx_bytes += b.size;
+    }
+    break;
+  case X8H7_ECHO_BENCH_DEFER:
+    ret = x8h7_echo_defer(&b, gen, X8H7_ECHO_OC_SINK);
+    break;
+  case X8H7_ECHO_BENCH_STREAM:
+    ret = x8h7_echo_defer(&b, gen, X8H7_ECHO_OC_ECHO);
+    if (ret < 0) {
+      break;
+    }
+    timeout = usecs_to_jiffies((u64)b.count * X8H7_ECHO_PKT_TIMEOUT_US) + X8H7_RX_TIMEOUT;
+    ret = wait_event_interruptible_timeout(priv->wait,
+                                           READ_ONCE(priv->rx_pkts) >= b.count,
+                                           timeout);
+    /* Close the run, echoes still in flight are discarded as stale */
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    priv->gen++;
+    b.rx_bytes = priv->rx_bytes;
+    b.errors = priv->rx_errors + (b.count - min(priv->rx_pkts, b.count));
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    ret = (ret < 0) ? ret : 0;
+    break;
+  }
+  b.elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  mutex_unlock(&priv->lock);
+
+  DBG_PRINT("mode %u count %u size %u: %llu ns, %u errors\n",
+            b.mode, b.count, b.size, b.elapsed_ns, b.errors);
+  if ((ret == 0) && lat &&
+      copy_to_user(u64_to_user_ptr(b.lat_ns), lat, b.count * sizeof(*lat))) {
+    ret = -EFAULT;
+  }
+  kvfree(lat);
+  if ((ret == 0) && copy_to_user(ub, &b, sizeof(b))) {
+    ret = -EFAULT;
+  }
+  return ret;
+}
+
+static long x8h7_echo_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct x8h7_echo_priv  *priv = x8h7_echo;
+
+  switch (cmd) {
+  case X8H7_IOCTL_ECHO_BENCH:
+    return x8h7_echo_bench_run(priv, (struct x8h7_echo_bench __user *)arg);
+  default:
+    return -ENOTTY;
+  }
+}
+
+static const struct file_operations x8h7_echo_fops = {
+  .owner          = THIS_MODULE,
+  .unlocked_ioctl = x8h7_echo_ioctl,
+};
+
+static int x8h7_echo_probe(struct platform_device *pdev)
+{
+  struct x8h7_echo_priv  *priv;
+  x8h7_pkt_t              rsp;
+  uint8_t                 data[X8H7_ECHO_SIZE_MIN];
+  int                     ret;
+
+  priv = devm_kzalloc(&pdev->dev, sizeof(*priv), GFP_KERNEL);
+  if (!priv) {
+    return -ENOMEM;
+  }
+  mutex_init(&priv->lock);
+  init_waitqueue_head(&priv->wait);
+  spin_lock_init(&priv->rx_lock);
+
+  x8h7_echo = priv;
+  platform_set_drvdata(pdev, priv);
+
+  ret = alloc_chrdev_region(&priv->dev_num, 0, 1, DRIVER_NAME);
+  if (ret < 0) {
+    DBG_ERROR("failed to allocate major number\n");
+    return ret;
+  }
+
+  priv->cl = class_create(THIS_MODULE, DRIVER_NAME);
+  if (IS_ERR(priv->cl)) {
+    DBG_ERROR("Class creation failed\n");
+    unregister_chrdev_region(priv->dev_num, 1);
+    return PTR_ERR(priv->cl);
+  }
+
+  priv->dev = device_create(priv->cl, NULL, priv->dev_num, NULL, DRIVER_NAME);
+  if (IS_ERR(priv->dev)) {
+    DBG_ERROR("Device creation failed\n");
+    class_destroy(priv->cl);
+    unregister_chrdev_region(priv->dev_num, 1);
+    return PTR_ERR(priv->dev);
+  }
+
+  cdev_init(&priv->cdev, &x8h7_echo_fops);
+  ret = cdev_add(&priv->cdev, priv->dev_num, 1);
+  if (ret < 0) {
+    DBG_ERROR("Device addition failed\n");
+    device_destroy(priv->cl, priv->dev_num);
+    class_destroy(priv->cl);
+    unregister_chrdev_region(priv->dev_num, 1);
+    return ret;
+  }
+
+  ret = x8h7_hook_set(X8H7_ECHO_PERIPH, x8h7_echo_hook, priv);
+  if (ret < 0) {
+    dev_err(&pdev->dev, "peripheral-id %u: hook failed %d\n", X8H7_ECHO_PERIPH, ret);
+    cdev_del(&priv->cdev);
+    device_destroy(priv->cl, priv->dev_num);
+    class_destroy(priv->cl);
+    unregister_chrdev_region(priv->dev_num, 1);
+    return ret;
+  }
+
+  /* Firmwares without the echo peripheral just don't answer */
+  x8h7_echo_fill(data, sizeof(data), 0, 0);
+  if (x8h7_pkt_send_recv(X8H7_ECHO_PERIPH, X8H7_ECHO_OC_ECHO, sizeof(data), data, &rsp) < 0) {
+    dev_warn(&pdev->dev, "no answer from the H7 echo peripheral\n");
+  }
+
+  return 0;
+}
+
+static int x8h7_echo_remove(struct platform_device *pdev)
+{
+  struct x8h7_echo_priv *priv = platform_get_drvdata(pdev);
+
+  x8h7_hook_set(X8H7_ECHO_PERIPH, NULL, NULL);
+  cdev_del(&priv->cdev);
+  device_destroy(priv->cl, priv->dev_num);
+  class_destroy(priv->cl);
+  unregister_chrdev_region(priv->dev_num, 1);
+  return 0;
+}
+
+static const struct of_device_id x8h7_echo_of_match[] = {
+  { .compatible = "portenta,x8h7_echo"},
+  { },
+};
+MODULE_DEVICE_TABLE(of, x8h7_echo_of_match);
+
+static struct platform_driver x8h7_echo_driver = {
+  .driver = {
+    .name           = DRIVER_NAME,
+    .of_match_table = x8h7_echo_of_match,
+  },
+  .probe  = x8h7_echo_probe,
+  .remove = x8h7_echo_remove,
+};
+
+module_platform_driver(x8h7_echo_driver);
+
+MODULE_AUTHOR("Massimiliano Agneni <massimiliano@iptronix.com");
+MODULE_DESCRIPTION("Arduino Portenta X8 link loopback and benchmark driver");
+MODULE_LICENSE("GPL v2");
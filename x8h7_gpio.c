@@ -3,8 +3,8 @@
  */
 
 #include <linux/module.h>
+#include <linux/bitmap.h>
 #include <linux/device.h>
-#include <linux/wait.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
 #include <linux/gpio.h>
@@ -28,9 +28,12 @@
 #define X8H7_GPIO_OC_DIR    0x10
 #define X8H7_GPIO_OC_IRQ_TYPE    0x11
 #define X8H7_GPIO_OC_WR     0x20
+#define X8H7_GPIO_OC_WR_MULTI 0x21
 #define X8H7_GPIO_OC_RD     0x30
+#define X8H7_GPIO_OC_RD_MULTI 0x31
 #define X8H7_GPIO_OC_IEN    0x40
-#define X8H7_GPIO_OC_INT    0x50
+#define X8H7_GPIO_OC_INT    0x50  // one line number per byte
+#define X8H7_GPIO_OC_INT_TS 0x51  // x8h7_gpio_int_ts_message entries
 #define X8H7_GPIO_OC_IACK   0x60
 
 //#define GPIO_MODE_INPUT         0x00   /*!< Input Floating Mode */
@@ -51,24 +54,36 @@
 
 #define X8H7_GPIO_NUM   34
 
+/* Payload of X8H7_GPIO_OC_WR_MULTI and of the X8H7_GPIO_OC_RD_MULTI
+ * response, the request only carries the mask. Bit n is gpio n.
+ */
+struct __attribute__((packed)) x8h7_gpio_multi_message {
+  uint64_t mask;
+  uint64_t value;
+};
+
+/* Entry of X8H7_GPIO_OC_INT_TS, timestamp in H7 microseconds */
+struct __attribute__((packed)) x8h7_gpio_int_ts_message {
+  uint8_t  line;
+  uint32_t timestamp;
+};
+
 struct x8h7_gpio_info {
   struct device      *dev;
-  wait_queue_head_t   wait;
-  int                 rx_cnt;
   int                 tx_cnt;
-  x8h7_pkt_t          rx_pkt;
   struct pinctrl_dev *pctldev;
   struct pinctrl_desc pinctrl_desc;
   struct gpio_chip    gc;
-  uint32_t            gpio_dir;
-  uint32_t            gpio_val;
+  uint64_t            gpio_dir;
+  uint64_t            gpio_val;
+  bool                multi;  // H7 handles the *_MULTI opcodes
   uint8_t             gpio_ien;
   uint8_t             irq_conf;
   struct irq_domain  *irq;
   struct mutex lock;
   struct work_struct work;
   struct workqueue_struct *workqueue;
-  uint64_t offload_irq;
+  DECLARE_BITMAP(pending, X8H7_GPIO_NUM);  // lines waiting for gpio_irq_work_func
 };
 
 // @TODO: add remaining gpios
@@ -116,54 +131,56 @@ static void x8h7_gpio_irq_offload(struct x8h7_gpio_info *inf)
     queue_work(inf->workqueue, &inf->work);
 }
 
-/* Worqueue for gpio_irq_ack handling */
+/* Worqueue for gpio_irq_ack handling, drains all the pending lines */
 static void gpio_irq_work_func(struct work_struct *work)
 {
   struct x8h7_gpio_info *inf = container_of(work, struct x8h7_gpio_info, work);
   unsigned long irq = 0;
-  uint8_t hwirq = inf->offload_irq;
+  unsigned int hwirq;
 
-  irq = irq_linear_revmap(inf->irq, hwirq);
-  handle_nested_irq(irq);
-  DBG_PRINT("call handle_nested_irq(%d)\n", hwirq);
-  return;
+  for_each_set_bit(hwirq, inf->pending, X8H7_GPIO_NUM) {
+    if (!test_and_clear_bit(hwirq, inf->pending)) {
+      continue;
+    }
+    irq = irq_linear_revmap(inf->irq, hwirq);
+    handle_nested_irq(irq);
+    DBG_PRINT("call handle_nested_irq(%d)\n", hwirq);
+  }
 }
 
-static void x8h7_gpio_hook(void *priv, x8h7_pkt_t *pkt)
+static void x8h7_gpio_irq_pending(struct x8h7_gpio_info *inf, uint8_t hwirq)
 {
-  struct x8h7_gpio_info  *inf = (struct x8h7_gpio_info*)priv;
-  unsigned long irq = 0;
-  uint8_t hwirq = 0;
-
-  if ((pkt->peripheral == X8H7_GPIO_PERIPH) &&
-      (pkt->opcode == X8H7_GPIO_OC_INT) &&
-      (pkt->size == 1)) {
-    if (pkt->data[0] < X8H7_GPIO_NUM) {
-      hwirq = pkt->data[0];
-      inf->offload_irq = hwirq;
-      x8h7_gpio_irq_offload(inf);
-      DBG_PRINT("call x8h7_gpio_irq(%d)\n", inf->offload_irq);
-    }
-  } else {
-    memcpy(&inf->rx_pkt, pkt, sizeof(x8h7_pkt_t));
-    inf->rx_cnt++;
-    wake_up_interruptible(&inf->wait);
+  if (hwirq < X8H7_GPIO_NUM) {
+    set_bit(hwirq, inf->pending);
+    DBG_PRINT("pending x8h7_gpio_irq(%d)\n", hwirq);
   }
 }
 
-static int x8h7_gpio_pkt_get(struct x8h7_gpio_info *inf)
+static void x8h7_gpio_hook(void *priv, uint8_t opcode, const uint8_t *data,
+                           uint16_t size)
 {
-  long ret;
-
-  ret = wait_event_interruptible_timeout(inf->wait,
-                                         inf->rx_cnt != 0,
-                                         X8H7_RX_TIMEOUT);
-  if (!ret) {
-    DBG_ERROR("timeout expired");
-    return -1;
+  struct x8h7_gpio_info  *inf = (struct x8h7_gpio_info*)priv;
+  struct x8h7_gpio_int_ts_message ts;
+  int i;
+
+  switch (opcode) {
+  case X8H7_GPIO_OC_INT:
+    for (i = 0; i < size; i++) {
+      x8h7_gpio_irq_pending(inf, data[i]);
+    }
+    break;
+  case X8H7_GPIO_OC_INT_TS:
+    /* gpiolib has no use for the timestamps, only the lines are kept */
+    for (i = 0; i + sizeof(ts) <= size; i += sizeof(ts)) {
+      memcpy(&ts, &data[i], sizeof(ts));
+      DBG_PRINT("line %d at %u us\n", ts.line, ts.timestamp);
+      x8h7_gpio_irq_pending(inf, ts.line);
+    }
+    break;
+  default:
+    return;
   }
-  inf->rx_cnt--;
-  return 0;
+  x8h7_gpio_irq_offload(inf);
 }
 
 static int x8h7_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
@@ -176,14 +193,14 @@ static int x8h7_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
     DBG_ERROR("offset out of reange\n");
     return -EINVAL;
   }
-  inf->gpio_dir &= ~(1 << offset);
+  inf->gpio_dir &= ~BIT_ULL(offset);
 
   data[0] = offset;
   data[1] = GPIO_MODE_INPUT;
 
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_DIR, 2, data);
 
-  DBG_PRINT(" dir %08X\n", inf->gpio_dir);
+  DBG_PRINT(" dir %09llX\n", inf->gpio_dir);
   return 0;
 }
 
@@ -191,6 +208,8 @@ static int x8h7_gpio_get(struct gpio_chip *chip, unsigned offset)
 {
   struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
   uint8_t                 data[1];
+  x8h7_pkt_t              rsp;
+  int                     ret;
 
   DBG_PRINT("offset: %d\n", offset);
   if (offset >= inf->gc.ngpio) {
@@ -198,22 +217,25 @@ static int x8h7_gpio_get(struct gpio_chip *chip, unsigned offset)
     return -EINVAL;
   }
 
+  /* Outputs are driven by us, no need to ask the H7 */
+  if (inf->gpio_dir & BIT_ULL(offset)) {
+    return !!(inf->gpio_val & BIT_ULL(offset));
+  }
+
   data[0] = offset;
-  x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD, 1, data);
-  if (x8h7_gpio_pkt_get(inf) < 0)
-    return -ETIMEDOUT;
-
-  if ((inf->rx_pkt.peripheral == X8H7_GPIO_PERIPH) &&
-      (inf->rx_pkt.opcode == X8H7_GPIO_OC_RD) &&
-      (inf->rx_pkt.size == 2)) {
-    if (inf->rx_pkt.data[1]) {
-      inf->gpio_val |= 1 << offset;
+  ret = x8h7_pkt_send_recv(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD, 1, data, &rsp);
+  if (ret < 0)
+    return ret;
+
+  if ((rsp.size == 2) && (rsp.data[0] == offset)) {
+    if (rsp.data[1]) {
+      inf->gpio_val |= BIT_ULL(offset);
     } else {
-      inf->gpio_val &= ~(1 << offset);
+      inf->gpio_val &= ~BIT_ULL(offset);
     }
   }
-  DBG_PRINT("read %08X\n", inf->gpio_val);
-  return !!(inf->gpio_val & (1 << offset));
+  DBG_PRINT("read %09llX\n", inf->gpio_val);
+  return !!(inf->gpio_val & BIT_ULL(offset));
 }
 
 static int x8h7_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
@@ -227,11 +249,11 @@ static int x8h7_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
     DBG_ERROR("offset out of reange\n");
     return -EINVAL;
   }
-  inf->gpio_dir |= (1 << offset);
+  inf->gpio_dir |= BIT_ULL(offset);
   if (value) {
-    inf->gpio_val |= (1 << offset);
+    inf->gpio_val |= BIT_ULL(offset);
   } else {
-    inf->gpio_val &= ~(1 << offset);
+    inf->gpio_val &= ~BIT_ULL(offset);
   }
   data[0] = offset;
   data[1] = !!value;
@@ -239,7 +261,7 @@ static int x8h7_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
   data[1] = GPIO_MODE_OUTPUT_PP;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_DIR, 2, data);
 
-  DBG_PRINT("dir %08X write %08X\n", inf->gpio_dir, inf->gpio_val);
+  DBG_PRINT("dir %09llX write %09llX\n", inf->gpio_dir, inf->gpio_val);
   return 0;
 }
 
@@ -255,16 +277,145 @@ static void x8h7_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
   }
 
   if (value) {
-    inf->gpio_val |= (1 << offset);
+    inf->gpio_val |= BIT_ULL(offset);
   } else {
-    inf->gpio_val &= ~(1 << offset);
+    inf->gpio_val &= ~BIT_ULL(offset);
   }
 
   data[0] = offset;
   data[1] = !!value;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR, 2, data);
 
-  DBG_PRINT("write %08X\n", inf->gpio_val);
+  DBG_PRINT("write %09llX\n", inf->gpio_val);
+}
+
+/**
+ * Read the inputs in *mask with one SPI transaction, outputs come from
+ * the cache. Without X8H7_GPIO_OC_RD_MULTI the per pin requests are all
+ * queued in the same frame.
+ */
+static int x8h7_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+                                  unsigned long *bits)
+{
+  struct x8h7_gpio_info          *inf = gpiochip_get_data(chip);
+  struct x8h7_req                *req[X8H7_GPIO_NUM];
+  struct x8h7_gpio_multi_message  msg;
+  x8h7_pkt_t                      rsp;
+  uint64_t                        want;
+  uint64_t                        in;
+  uint64_t                        val = 0;
+  unsigned int                    n = 0;
+  unsigned int                    i;
+  uint8_t                         offset;
+  int                             ret = 0;
+
+  bitmap_to_arr64(&want, mask, X8H7_GPIO_NUM);
+  in = want & ~inf->gpio_dir;
+  DBG_PRINT("mask %09llX in %09llX\n", want, in);
+
+  if (in && inf->multi) {
+    msg.mask = in;
+    ret = x8h7_pkt_send_recv(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD_MULTI,
+                             sizeof(msg.mask), &msg.mask, &rsp);
+    if (ret < 0) {
+      return ret;
+    }
+    if (rsp.size != sizeof(msg)) {
+      DBG_ERROR("invalid multi read response size %d\n", rsp.size);
+      return -EIO;
+    }
+    memcpy(&msg, rsp.data, sizeof(msg));
+    val = msg.value & msg.mask & in;
+  } else if (in) {
+    for (i = 0; i < X8H7_GPIO_NUM; i++) {
+      if (!(in & BIT_ULL(i))) {
+        continue;
+      }
+      offset = i;
+      req[n] = x8h7_req_submit(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD, 1, &offset);
+      if (IS_ERR(req[n])) {
+        ret = PTR_ERR(req[n]);
+        break;
+      }
+      n++;
+    }
+    x8h7_pkt_send_now();
+    for (i = 0; i < n; i++) {
+      int err = x8h7_req_wait(req[i], &rsp, X8H7_RX_TIMEOUT);
+
+      if (err < 0) {
+        ret = ret ? ret : err;
+        continue;
+      }
+      if ((rsp.size == 2) && (rsp.data[0] < X8H7_GPIO_NUM) && rsp.data[1]) {
+        val |= BIT_ULL(rsp.data[0]);
+      }
+    }
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  inf->gpio_val = (inf->gpio_val & ~in) | val;
+  val = inf->gpio_val & want;
+  bitmap_from_arr64(bits, &val, X8H7_GPIO_NUM);
+  DBG_PRINT("read %09llX\n", inf->gpio_val);
+  return 0;
+}
+
+/**
+ * Drive all the pins in *mask with one SPI transaction
+ */
+static void x8h7_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+                                   unsigned long *bits)
+{
+  struct x8h7_gpio_info          *inf = gpiochip_get_data(chip);
+  struct x8h7_gpio_multi_message  msg;
+  uint64_t                        want;
+  uint64_t                        val;
+  uint8_t                         data[2];
+  unsigned int                    i;
+
+  bitmap_to_arr64(&want, mask, X8H7_GPIO_NUM);
+  bitmap_to_arr64(&val, bits, X8H7_GPIO_NUM);
+  inf->gpio_val = (inf->gpio_val & ~want) | (val & want);
+  DBG_PRINT("mask %09llX write %09llX\n", want, inf->gpio_val);
+
+  if (inf->multi) {
+    msg.mask = want;
+    msg.value = inf->gpio_val & want;
+    x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR_MULTI,
+                       sizeof(msg), &msg);
+    return;
+  }
+
+  for (i = 0; i < X8H7_GPIO_NUM; i++) {
+    if (!(want & BIT_ULL(i))) {
+      continue;
+    }
+    data[0] = i;
+    data[1] = !!(inf->gpio_val & BIT_ULL(i));
+    if (x8h7_pkt_send_defer(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR, 2, data) < 0) {
+      /* Frame full, flush it and go on */
+      x8h7_pkt_send_now();
+      x8h7_pkt_send_defer(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR, 2, data);
+    }
+  }
+  x8h7_pkt_send_now();
+}
+
+/**
+ * Older H7 firmware ignores X8H7_GPIO_OC_RD_MULTI, probe it once
+ */
+static void x8h7_gpio_multi_probe(struct x8h7_gpio_info *inf)
+{
+  uint64_t    mask = 0;
+  x8h7_pkt_t  rsp;
+
+  inf->multi = (x8h7_pkt_send_recv(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD_MULTI,
+                                   sizeof(mask), &mask, &rsp) == 0) &&
+               (rsp.size == sizeof(struct x8h7_gpio_multi_message));
+  DBG_PRINT("multi pin opcodes %ssupported\n", inf->multi ? "" : "not ");
 }
 
 static int x8h7_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
@@ -272,7 +423,7 @@ static int x8h7_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
   struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
 
   DBG_PRINT("offset: %d\n", offset);
-  if (inf->gpio_dir & (1 << offset)) {
+  if (inf->gpio_dir & BIT_ULL(offset)) {
     return GPIOF_DIR_OUT;
   }
   return GPIOF_DIR_IN;
@@ -563,8 +714,6 @@ static int x8h7_gpio_probe(struct platform_device *pdev)
   }
 
   inf->dev = &pdev->dev;
-  init_waitqueue_head(&inf->wait);
-  inf->rx_cnt = 0;
   inf->tx_cnt = 0;
 
   mutex_init(&inf->lock);
@@ -603,12 +752,15 @@ static int x8h7_gpio_probe(struct platform_device *pdev)
   inf->gc.get              = x8h7_gpio_get;
   inf->gc.direction_output = x8h7_gpio_direction_output;
   inf->gc.set              = x8h7_gpio_set;
+  inf->gc.get_multiple     = x8h7_gpio_get_multiple;
+  inf->gc.set_multiple     = x8h7_gpio_set_multiple;
   inf->gc.get_direction    = x8h7_gpio_get_direction;
   inf->gc.set_config       = x8h7_gpio_set_config;
   inf->gc.to_irq           = x8h7_gpio_to_irq;
   inf->gc.base             = base;
   inf->gc.ngpio            = X8H7_GPIO_NUM;
   inf->gc.parent           = &pdev->dev;
+  inf->gc.can_sleep        = true;
 #ifdef CONFIG_OF_GPIO
   inf->gc.of_node          = pdev->dev.of_node;
 #endif
@@ -629,6 +781,7 @@ static int x8h7_gpio_probe(struct platform_device *pdev)
   }
 
   x8h7_hook_set(X8H7_GPIO_PERIPH, x8h7_gpio_hook, inf);
+  x8h7_gpio_multi_probe(inf);
 
   return 0;
 }
@@ -11,6 +11,13 @@
 #include <linux/list.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/kfifo.h>
 
 #include "x8h7.h"
 #include "x8h7_ioctl.h"
@@ -31,6 +38,7 @@
 #define X8H7_H7_DATA_MAX    (4096)
 #define X8H7_H7_LIST_SIZE   16
 #define X8H7_H7_RX_TIMEOUT  (2 * HZ)
+#define X8H7_H7_TAP_FIFO    (16 * 1024)
 
 
 struct x8h7_h7_buf {
@@ -53,11 +61,27 @@ struct x8h7_h7_priv {
   uint8_t             rx_data[X8H7_H7_DATA_MAX];
   uint16_t            rx_len;
 */
-  x8h7_pkt_t          rx_pkt;
 
+  spinlock_t          lock;     /* rx queue and ring against the SPI thread */
   int                 rxindex;
   struct list_head    rxqueue;
   struct x8h7_h7_buf  buf[X8H7_H7_LIST_SIZE];
+  u64                 overruns;
+
+  /* mmap capture ring, see x8h7_ioctl.h */
+  struct mutex        ring_mutex;
+  void               *ring;
+  u32                 ring_size;  /* data area, kernel copy */
+  u64                 ring_head;
+  u64                 ring_dropped;
+  u32                 ring_seq;
+  int                 ring_maps;
+
+  /* Packets of the tapped peripherals, filled by the SPI thread */
+  struct mutex        tap_mutex;  /* reader and TAP_SET */
+  u32                 tap_mask;
+  u64                 tap_dropped;
+  DECLARE_KFIFO(tap_fifo, u8, X8H7_H7_TAP_FIFO);
 };
 
 union x8h7_h7_uid_message
@@ -85,63 +109,253 @@ static void x8h7_h7_init_rx_queue(struct x8h7_h7_priv *priv)
 }
 */
 
-static void x8h7_h7_hook(void *prv, x8h7_pkt_t *pkt)
+/**
+ * Append a frame to the capture ring, lock held.
+ * The header is shared with userspace: only tail is read from it.
+ */
+static void x8h7_h7_ring_put(struct x8h7_h7_priv *priv, uint8_t *data, uint16_t len)
 {
-  struct x8h7_h7_priv *priv = (struct x8h7_h7_priv *)prv;
-  /*
-  if ((pkt->peripheral == X8H7_H7_PERIPH) &&
-      (pkt->opcode == X8H7_H7_OC_FW_GET) &&
-      (pkt->size >= 1)) {
-    // copy fw version
-    pkt->data[pkt->size] = 0;
-    DBG_PRINT("FW ver size %d %s\n", pkt->size, pkt->data);
+  struct x8h7_ring_hdr  *hdr = priv->ring;
+  struct x8h7_ring_rec  *rec;
+  uint8_t               *base = (uint8_t *)priv->ring + X8H7_RING_HDR_SIZE;
+  u32                    size = priv->ring_size;
+  u64                    tail = smp_load_acquire(&hdr->tail);
+  u64                    head = priv->ring_head;
+  u64                    used = head - tail;
+  u32                    rec_len = ALIGN(sizeof(*rec) + len, 8);
+  u32                    off = head & (size - 1);
+  u32                    to_end = size - off;
+  u32                    need = rec_len + ((to_end < rec_len) ? to_end : 0);
+
+  priv->ring_seq++;
+  if ((used > size) || (size - used < need)) {
+    /* Full, or a bogus tail from the reader */
+    priv->ring_dropped++;
+    WRITE_ONCE(hdr->dropped, priv->ring_dropped);
+    return;
   }
-*/
-  memcpy(&priv->rx_pkt, pkt, sizeof(x8h7_pkt_t));
-  priv->cnt++;
-  wake_up_interruptible(&priv->wait);
+
+  if (to_end < rec_len) {
+    if (to_end >= sizeof(*rec)) {
+      rec = (struct x8h7_ring_rec *)(base + off);
+      rec->seq   = 0;
+      rec->len   = to_end - sizeof(*rec);
+      rec->flags = X8H7_RING_REC_PAD;
+      rec->ts_ns = 0;
+    }
+    head += to_end;
+    off = 0;
+  }
+
+  rec = (struct x8h7_ring_rec *)(base + off);
+  rec->seq   = priv->ring_seq;
+  rec->len   = len;
+  rec->flags = 0;
+  rec->ts_ns = ktime_get_ns();
+  memcpy(rec + 1, data, len);
+  head += rec_len;
+
+  priv->ring_head = head;
+  /* Record visible before the reader sees the new head */
+  smp_store_release(&hdr->head, head);
 }
 
-static int x8h7_h7_pkt_get(struct x8h7_h7_priv *priv)
+/**
+ * Raw frame hook, runs in the SPI thread. Frames go to the capture
+ * ring when set up, else to the rx queue read one per read().
+ */
+static void x8h7_h7_dbg(void *prv, uint8_t *data, uint16_t len)
 {
-  long ret;
+  struct x8h7_h7_priv  *priv = (struct x8h7_h7_priv*)prv;
+  unsigned long         flags;
 
-  ret = wait_event_interruptible_timeout(priv->wait,
-                                         priv->cnt != 0,
-                                         X8H7_RX_TIMEOUT);
-  if (!ret) {
-    DBG_ERROR("timeout expired");
-    return -1;
+  if (len > X8H7_H7_DATA_MAX) {
+    len = X8H7_H7_DATA_MAX;
   }
-  priv->cnt--;
-  return 0;
+
+  spin_lock_irqsave(&priv->lock, flags);
+  if (priv->ring) {
+    x8h7_h7_ring_put(priv, data, len);
+  } else if (priv->cnt >= X8H7_H7_LIST_SIZE) {
+    /* Every buffer is queued, don't reuse one still on the list */
+    priv->overruns++;
+    DBG_ERROR("Receive overrun cnt %d\n", priv->cnt);
+  } else {
+    memcpy(priv->buf[priv->rxindex].data, data, len);
+    priv->buf[priv->rxindex].len = len;
+    list_add_tail(&priv->buf[priv->rxindex].list, &priv->rxqueue);
+    priv->rxindex++;
+    if (priv->rxindex >= X8H7_H7_LIST_SIZE) {
+      priv->rxindex = 0;
+    }
+    priv->cnt++;
+  }
+  spin_unlock_irqrestore(&priv->lock, flags);
+
+  wake_up_interruptible(&priv->wait);
 }
 
-static void x8h7_h7_dbg(void *prv, uint8_t *data, uint16_t len)
+/**
+ * Tap hook, runs in the SPI thread. Sole producer of tap_fifo,
+ * records are dropped whole when they don't fit.
+ */
+static void x8h7_h7_tap(void *prv, uint8_t peripheral, uint8_t opcode,
+                        const uint8_t *data, uint16_t size)
 {
   struct x8h7_h7_priv  *priv = (struct x8h7_h7_priv*)prv;
+  struct x8h7_pkt_rec   rec;
 
-  //if (priv->cnt) {
-    //DBG_ERROR("Receive override cnt %d\n", priv->cnt);
-  //}
-  //DBG_PRINT("Received %d bytes\n", len);
-/**/
-  memcpy(priv->buf[priv->rxindex].data, data, len);
-  priv->buf[priv->rxindex].len = len;
-  list_add_tail(&priv->buf[priv->rxindex].list, &priv->rxqueue);
-  priv->rxindex++;
-  if (priv->rxindex >= X8H7_H7_LIST_SIZE) {
-    priv->rxindex = 0;
+  if (kfifo_avail(&priv->tap_fifo) < sizeof(rec) + size) {
+    priv->tap_dropped++;
+    DBG_ERROR("tap overrun, dropped %llu\n", priv->tap_dropped);
+    return;
   }
-/**/
-/*
-  memcpy(priv->rx_data, data, len);
-  priv->rx_len = len;
-*/
-  priv->cnt++;
+  rec.peripheral = peripheral;
+  rec.opcode     = opcode;
+  rec.size       = size;
+  kfifo_in(&priv->tap_fifo, (u8 *)&rec, sizeof(rec));
+  kfifo_in(&priv->tap_fifo, data, size);
+
   wake_up_interruptible(&priv->wait);
 }
 
+/**
+ * True when a whole record is in the fifo. The header and the payload
+ * are published by two kfifo_in, don't take a header alone.
+ */
+static bool x8h7_h7_tap_ready(struct x8h7_h7_priv *priv)
+{
+  struct x8h7_pkt_rec   rec;
+
+  if (kfifo_out_peek(&priv->tap_fifo, (u8 *)&rec, sizeof(rec)) != sizeof(rec)) {
+    return false;
+  }
+  return kfifo_len(&priv->tap_fifo) >= sizeof(rec) + rec.size;
+}
+
+/**
+ * Hand out as many whole tap records as fit count
+ */
+static ssize_t x8h7_h7_tap_read(struct x8h7_h7_priv *priv, struct file *file,
+                                char __user *buf, size_t count)
+{
+  struct x8h7_pkt_rec   rec;
+  unsigned int          copied;
+  size_t                len = 0;
+  int                   ret = 0;
+
+  if (mutex_lock_interruptible(&priv->tap_mutex)) {
+    return -ERESTARTSYS;
+  }
+  while (!x8h7_h7_tap_ready(priv)) {
+    mutex_unlock(&priv->tap_mutex);
+    if (file->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    ret = wait_event_interruptible(priv->wait,
+                                   x8h7_h7_tap_ready(priv) ||
+                                   !READ_ONCE(priv->tap_mask));
+    if (ret < 0) {
+      return ret;
+    }
+    if (!READ_ONCE(priv->tap_mask)) {
+      return 0;
+    }
+    if (mutex_lock_interruptible(&priv->tap_mutex)) {
+      return -ERESTARTSYS;
+    }
+  }
+
+  while (x8h7_h7_tap_ready(priv)) {
+    kfifo_out_peek(&priv->tap_fifo, (u8 *)&rec, sizeof(rec));
+    if (len + sizeof(rec) + rec.size > count) {
+      break;
+    }
+    ret = kfifo_to_user(&priv->tap_fifo, buf + len, sizeof(rec) + rec.size, &copied);
+    if (ret < 0) {
+      break;
+    }
+    len += copied;
+  }
+  mutex_unlock(&priv->tap_mutex);
+
+  if (!len) {
+    /* count can't hold the next record */
+    return ret ? ret : -EMSGSIZE;
+  }
+  return len;
+}
+
+/**
+ * Route the packets of the peripherals in mask to read(), 0 stops it
+ */
+static long x8h7_h7_tap_setup(struct x8h7_h7_priv *priv, u32 mask)
+{
+  long  ret;
+
+  mutex_lock(&priv->tap_mutex);
+  /* Once it returns no tap is running, the fifo has no producer */
+  x8h7_tap_set(0, NULL, NULL);
+  WRITE_ONCE(priv->tap_mask, 0);
+  kfifo_reset(&priv->tap_fifo);
+  priv->tap_dropped = 0;
+  ret = x8h7_tap_set(mask, x8h7_h7_tap, priv);
+  if ((ret == 0) && mask) {
+    WRITE_ONCE(priv->tap_mask, mask);
+  }
+  mutex_unlock(&priv->tap_mutex);
+  wake_up_interruptible(&priv->wait);
+
+  return ret;
+}
+
+/**
+ * Send a vector of packets, as many per frame as fit.
+ * Returns how many went out before an error, or the error if none did.
+ */
+static long x8h7_h7_pkt_submit(struct x8h7_pkt_vec __user *uvec)
+{
+  struct x8h7_pkt_vec   vec;
+  x8h7_pkt_t            pkt;
+  x8h7_pkt_t __user    *upkt;
+  u32                   i;
+  int                   ret = 0;
+
+  if (copy_from_user(&vec, uvec, sizeof(vec))) {
+    return -EFAULT;
+  }
+  if (vec.flags || !vec.cnt || (vec.cnt > X8H7_PKT_VEC_MAX)) {
+    return -EINVAL;
+  }
+  upkt = u64_to_user_ptr(vec.pkts);
+
+  for (i = 0; i < vec.cnt; i++) {
+    if (copy_from_user(&pkt, &upkt[i], sizeof(pkt))) {
+      ret = -EFAULT;
+      break;
+    }
+    if (pkt.size > X8H7_PKT_SIZE) {
+      ret = -EINVAL;
+      break;
+    }
+    ret = x8h7_pkt_send_defer(pkt.peripheral, pkt.opcode, pkt.size, pkt.data);
+    if (ret == -ENOMEM) {
+      /* Frame full, send it and start the next one */
+      x8h7_pkt_send_now();
+      ret = x8h7_pkt_send_defer(pkt.peripheral, pkt.opcode, pkt.size, pkt.data);
+    }
+    if (ret < 0) {
+      break;
+    }
+  }
+  if (i) {
+    x8h7_pkt_send_now();
+  }
+  DBG_PRINT("submitted %u/%u packets\n", i, vec.cnt);
+
+  return i ? i : ret;
+}
+
 static int x8h7_h7_open(struct inode *inode, struct file *file)
 {
 //  DBG_PRINT("\n");
@@ -160,19 +374,37 @@ static ssize_t x8h7_h7_read(struct file *file,
   struct x8h7_h7_priv  *priv = x8h7_h7;
   long                  ret;
   struct x8h7_h7_buf *rxbuf;
+  unsigned long         flags;
 
+  if (READ_ONCE(priv->tap_mask)) {
+    return x8h7_h7_tap_read(priv, file, buf, count);
+  }
   if ((priv->mode & X8H7_MODE_DEBUG) == 0) {
     return -1;
   }
+  if (priv->ring) {
+    /* Frames go to the mmap ring */
+    return -EBUSY;
+  }
   ret = wait_event_interruptible_timeout(priv->wait,
                                          priv->cnt != 0,
                                          X8H7_H7_RX_TIMEOUT);
   if (!ret) {
     return -1;
   }
+  if (ret < 0) {
+    return ret;
+  }
 /**/
+  spin_lock_irqsave(&priv->lock, flags);
+  if (list_empty(&priv->rxqueue)) {
+    spin_unlock_irqrestore(&priv->lock, flags);
+    return 0;
+  }
   rxbuf = list_entry(priv->rxqueue.next, struct x8h7_h7_buf, list);
   list_del(priv->rxqueue.next);
+  spin_unlock_irqrestore(&priv->lock, flags);
+  /* The buffer stays ours until cnt is decremented */
   if (count > rxbuf->len) {
     count = rxbuf->len;
   }
@@ -180,7 +412,7 @@ static ssize_t x8h7_h7_read(struct file *file,
     rxbuf->len = 0;
     //DBG_PRINT("copy to user %d bytes\n", count);
     if (copy_to_user(buf, rxbuf->data, count)) {
-      return -EFAULT;
+      count = -EFAULT;
     }
   }
 /**/
@@ -196,10 +428,137 @@ static ssize_t x8h7_h7_read(struct file *file,
     }
   }
 */
+  spin_lock_irqsave(&priv->lock, flags);
   priv->cnt--;
+  spin_unlock_irqrestore(&priv->lock, flags);
   return count;
 }
 
+/**
+ * Ready to read when a frame is queued or the ring is not empty
+ */
+static __poll_t x8h7_h7_poll(struct file *file, poll_table *wait)
+{
+  struct x8h7_h7_priv  *priv = x8h7_h7;
+  struct x8h7_ring_hdr *hdr;
+  unsigned long         flags;
+  __poll_t              mask = 0;
+
+  poll_wait(file, &priv->wait, wait);
+
+  if (READ_ONCE(priv->tap_mask) && x8h7_h7_tap_ready(priv)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  spin_lock_irqsave(&priv->lock, flags);
+  if (priv->ring) {
+    hdr = priv->ring;
+    if (priv->ring_head != READ_ONCE(hdr->tail)) {
+      mask |= EPOLLIN | EPOLLRDNORM;
+    }
+  } else if (priv->cnt) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  spin_unlock_irqrestore(&priv->lock, flags);
+
+  return mask;
+}
+
+/**
+ * Replace the capture ring, size 0 just frees it.
+ * Not while it is mapped.
+ */
+static long x8h7_h7_ring_setup(struct x8h7_h7_priv *priv, u32 size)
+{
+  struct x8h7_ring_hdr *hdr = NULL;
+  unsigned long         flags;
+  void                 *old;
+  long                  ret = 0;
+
+  if (size && (!is_power_of_2(size) || (size < X8H7_RING_SIZE_MIN) ||
+               (size > X8H7_RING_SIZE_MAX) || (size % PAGE_SIZE) ||
+               (X8H7_RING_HDR_SIZE % PAGE_SIZE))) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&priv->ring_mutex);
+  if (priv->ring_maps) {
+    ret = -EBUSY;
+    goto out;
+  }
+  if (size) {
+    hdr = vmalloc_user(X8H7_RING_HDR_SIZE + size);
+    if (!hdr) {
+      ret = -ENOMEM;
+      goto out;
+    }
+    hdr->magic = X8H7_RING_MAGIC;
+    hdr->size  = size;
+  }
+
+  spin_lock_irqsave(&priv->lock, flags);
+  old = priv->ring;
+  priv->ring = hdr;
+  priv->ring_size = size;
+  priv->ring_head = 0;
+  priv->ring_dropped = 0;
+  priv->ring_seq = 0;
+  spin_unlock_irqrestore(&priv->lock, flags);
+
+  vfree(old);
+  DBG_PRINT("ring size %u\n", size);
+out:
+  mutex_unlock(&priv->ring_mutex);
+  return ret;
+}
+
+static void x8h7_h7_vm_open(struct vm_area_struct *vma)
+{
+  struct x8h7_h7_priv  *priv = vma->vm_private_data;
+
+  mutex_lock(&priv->ring_mutex);
+  priv->ring_maps++;
+  mutex_unlock(&priv->ring_mutex);
+}
+
+static void x8h7_h7_vm_close(struct vm_area_struct *vma)
+{
+  struct x8h7_h7_priv  *priv = vma->vm_private_data;
+
+  mutex_lock(&priv->ring_mutex);
+  priv->ring_maps--;
+  mutex_unlock(&priv->ring_mutex);
+}
+
+static const struct vm_operations_struct x8h7_h7_vm_ops = {
+  .open  = x8h7_h7_vm_open,
+  .close = x8h7_h7_vm_close,
+};
+
+/**
+ * Map the whole capture ring, header page first
+ */
+static int x8h7_h7_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct x8h7_h7_priv  *priv = x8h7_h7;
+  int                   ret;
+
+  mutex_lock(&priv->ring_mutex);
+  if (!priv->ring || vma->vm_pgoff ||
+      (vma->vm_end - vma->vm_start != X8H7_RING_HDR_SIZE + priv->ring_size)) {
+    ret = -EINVAL;
+  } else {
+    ret = remap_vmalloc_range(vma, priv->ring, 0);
+  }
+  if (!ret) {
+    vma->vm_ops = &x8h7_h7_vm_ops;
+    vma->vm_private_data = priv;
+    priv->ring_maps++;
+  }
+  mutex_unlock(&priv->ring_mutex);
+
+  return ret;
+}
+
 static ssize_t x8h7_h7_write(struct file *file,
                              const char __user *buf, size_t count, loff_t *offset)
 {
@@ -247,20 +606,17 @@ static long x8h7_h7_ioctl(struct file *file, unsigned int cmd, unsigned long arg
   }
   switch (cmd) {
   case X8H7_IOCTL_FW_VER:
-    x8h7_pkt_send_sync(X8H7_H7_PERIPH, X8H7_H7_OC_FW_GET, 0, NULL);
-    retval = x8h7_h7_pkt_get(priv);
+    retval = x8h7_pkt_send_recv(X8H7_H7_PERIPH, X8H7_H7_OC_FW_GET, 0, NULL, &pkt);
     if (retval < 0) {
-      return -ETIMEDOUT;
+      return retval;
     }
-    if ((priv->rx_pkt.peripheral == X8H7_H7_PERIPH) &&
-        (priv->rx_pkt.opcode == X8H7_H7_OC_FW_GET) &&
-        (priv->rx_pkt.size >= 1)) {
+    if (pkt.size >= 1) {
 
-      if (copy_to_user((void __user *)arg, &priv->rx_pkt, sizeof(x8h7_pkt_t))) {
+      if (copy_to_user((void __user *)arg, &pkt, sizeof(x8h7_pkt_t))) {
         DBG_ERROR("couldn't version information to user.");
         return -EFAULT;
       }
-      //return priv->rx_pkt.size;
+      //return pkt.size;
       //pkt->data[pkt->size] = 0;
       //DBG_PRINT("FW ver size %d %s\n", pkt->size, pkt->data);
       retval = 0;
@@ -272,8 +628,21 @@ static long x8h7_h7_ioctl(struct file *file, unsigned int cmd, unsigned long arg
     break;
   case X8H7_IOCTL_MODE_SET:
     retval = get_user(tmp, (u32 __user *)arg);
+    if ((retval == 0) && (tmp & X8H7_MODE_POWERSAVE) && (tmp & X8H7_MODE_LOWLATENCY)) {
+      retval = -EINVAL;
+    }
+    /* Callers only toggling the debug mode keep the current policy */
+    if ((retval == 0) && (tmp & X8H7_MODE_POLICY)) {
+      if (tmp & X8H7_MODE_POWERSAVE) {
+        retval = x8h7_link_policy_set(X8H7_LINK_POWERSAVE);
+      } else if (tmp & X8H7_MODE_LOWLATENCY) {
+        retval = x8h7_link_policy_set(X8H7_LINK_LOWLATENCY);
+      } else {
+        retval = x8h7_link_policy_set(X8H7_LINK_PERFORMANCE);
+      }
+    }
     if (retval == 0) {
-      priv->mode = tmp;
+      priv->mode = tmp & ~X8H7_MODE_POLICY_MASK;
       DBG_PRINT("Set mode to %08X\n", priv->mode);
       if (priv->mode & X8H7_MODE_DEBUG) {
         x8h7_dbg_set(x8h7_h7_dbg, x8h7_h7);
@@ -283,7 +652,33 @@ static long x8h7_h7_ioctl(struct file *file, unsigned int cmd, unsigned long arg
     }
     break;
   case X8H7_IOCTL_MODE_GET:
-    retval = put_user(priv->mode, (__u32 __user *)arg);
+    tmp = priv->mode;
+    switch (x8h7_link_policy_get()) {
+    case X8H7_LINK_POWERSAVE:
+      tmp |= X8H7_MODE_POWERSAVE;
+      break;
+    case X8H7_LINK_LOWLATENCY:
+      tmp |= X8H7_MODE_LOWLATENCY;
+      break;
+    default:
+      break;
+    }
+    retval = put_user(tmp, (__u32 __user *)arg);
+    break;
+  case X8H7_IOCTL_RING_SETUP:
+    retval = get_user(tmp, (u32 __user *)arg);
+    if (retval == 0) {
+      retval = x8h7_h7_ring_setup(priv, tmp);
+    }
+    break;
+  case X8H7_IOCTL_PKT_SUBMIT:
+    retval = x8h7_h7_pkt_submit((struct x8h7_pkt_vec __user *)arg);
+    break;
+  case X8H7_IOCTL_TAP_SET:
+    retval = get_user(tmp, (u32 __user *)arg);
+    if (retval == 0) {
+      retval = x8h7_h7_tap_setup(priv, tmp);
+    }
     break;
   case X8H7_IOCTL_PKT_SYNC_SEND:
     retval = copy_from_user(&pkt, (void __user *)arg, sizeof(pkt));
@@ -302,7 +697,7 @@ static long x8h7_h7_ioctl(struct file *file, unsigned int cmd, unsigned long arg
   case X8H7_IOCTL_INT_WAIT:
   case X8H7_IOCTL_PKT_INIT:
 */
-  if (retval) {
+  if (retval < 0) {
     DBG_ERROR("ioctl return error: %ld\n", retval);
   }
   return retval;
@@ -311,19 +706,18 @@ static long x8h7_h7_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 
 ssize_t x8h7_read_firmware_version(char * buf, size_t const buf_size)
 {
-  struct x8h7_h7_priv * priv = x8h7_h7;
+  x8h7_pkt_t  rsp;
+  int         ret;
 
-  x8h7_pkt_send_sync(X8H7_H7_PERIPH, X8H7_H7_OC_FW_GET, 0, NULL);
-  if (x8h7_h7_pkt_get(priv) < 0)
-    return -ETIMEDOUT;
+  ret = x8h7_pkt_send_recv(X8H7_H7_PERIPH, X8H7_H7_OC_FW_GET, 0, NULL, &rsp);
+  if (ret < 0)
+    return ret;
 
-  if ((priv->rx_pkt.peripheral == X8H7_H7_PERIPH) &&
-      (priv->rx_pkt.opcode == X8H7_H7_OC_FW_GET) &&
-      (priv->rx_pkt.size >= 1)) {
+  if (rsp.size >= 1) {
 
       memcpy(buf,
-             &priv->rx_pkt.data,
-             (priv->rx_pkt.size < buf_size) ? priv->rx_pkt.size : buf_size);
+             &rsp.data,
+             (rsp.size < buf_size) ? rsp.size : buf_size);
   } else {
     return -EFAULT;
   }
@@ -345,22 +739,22 @@ static ssize_t sysfs_show_version(struct kobject *kobj,
 
 ssize_t x8h7_read_chip_uid(char * buf, size_t const buf_size)
 {
-  struct x8h7_h7_priv * priv = x8h7_h7;
+  x8h7_pkt_t  rsp;
+  int         ret;
 
-  x8h7_pkt_send_sync(X8H7_H7_PERIPH, X8H7_GET_UID_REQ, 0, NULL);
-  if (x8h7_h7_pkt_get(priv) < 0)
-    return -ETIMEDOUT;
+  /* Request and response share the opcode, the reply is matched on it */
+  ret = x8h7_pkt_send_recv(X8H7_H7_PERIPH, X8H7_GET_UID_REQ, 0, NULL, &rsp);
+  if (ret < 0)
+    return ret;
 
-  if ((priv->rx_pkt.peripheral == X8H7_H7_PERIPH) &&
-      (priv->rx_pkt.opcode == X8H7_GET_UID_RSP) &&
-      (priv->rx_pkt.size >= 1)) {
+  if (rsp.size >= 1) {
 
     int i, len;
     union x8h7_h7_uid_message msg;
 
     memcpy(msg.buf,
-           &priv->rx_pkt.data,
-           (priv->rx_pkt.size < buf_size) ? priv->rx_pkt.size : sizeof(msg.buf));
+           &rsp.data,
+           (rsp.size < sizeof(msg.buf)) ? rsp.size : sizeof(msg.buf));
 
     i = 0; len = 0;
     for (i = 0; (i < sizeof(msg.buf)) && (len < buf_size); i++)
@@ -395,6 +789,8 @@ struct kobj_attribute x8h7_chip_uid_attr = __ATTR(chip_uid, 0444, sysfs_show_chi
   .release        = x8h7_h7_release,
   .read           = x8h7_h7_read,
   .write          = x8h7_h7_write,
+  .poll           = x8h7_h7_poll,
+  .mmap           = x8h7_h7_mmap,
   .unlocked_ioctl = x8h7_h7_ioctl,
 };
 
@@ -454,11 +850,14 @@ static int x8h7_h7_probe(struct platform_device *pdev)
   }
 
   init_waitqueue_head(&priv->wait);
+  spin_lock_init(&priv->lock);
+  mutex_init(&priv->ring_mutex);
+  mutex_init(&priv->tap_mutex);
+  INIT_KFIFO(priv->tap_fifo);
 /**/
   INIT_LIST_HEAD(&priv->rxqueue);
   priv->rxindex = 0;
 /**/
-  x8h7_hook_set(X8H7_H7_PERIPH, x8h7_h7_hook, priv);
 
   /* Creating a sysfs entry for reading the
    * firmware version of the X8H7 firmware.
@@ -482,7 +881,10 @@ static int x8h7_h7_remove(struct platform_device *pdev)
   struct x8h7_h7_priv *priv = platform_get_drvdata(pdev);
 
   x8h7_hook_set(X8H7_H7_PERIPH, NULL, NULL);
+  x8h7_dbg_set(NULL, NULL);
+  x8h7_tap_set(0, NULL, NULL);
   cdev_del(&priv->cdev);
+  vfree(priv->ring);
   device_destroy(priv->cl, priv->dev_num);
   class_destroy(priv->cl);
   unregister_chrdev_region(priv->dev_num, 1);
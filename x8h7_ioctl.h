@@ -7,7 +7,16 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
-#define X8H7_MODE_DEBUG   0x00000001
+#define X8H7_MODE_DEBUG       0x00000001
+/* Link policy, neither bit is performance, see x8h7_link_policy_set.
+ * MODE_SET only changes it with X8H7_MODE_POLICY set, MODE_GET always
+ * reports the current one, which may have been set through sysfs.
+ */
+#define X8H7_MODE_POWERSAVE   0x00000002
+#define X8H7_MODE_LOWLATENCY  0x00000004
+#define X8H7_MODE_POLICY      0x00000008
+#define X8H7_MODE_POLICY_MASK (X8H7_MODE_POWERSAVE | X8H7_MODE_LOWLATENCY | \
+                               X8H7_MODE_POLICY)
 
 #define X8H7_IOCTL_MAGIC     0xB5
 
@@ -16,7 +25,102 @@
 #define X8H7_IOCTL_FW_VER         _IOR  (X8H7_IOCTL_MAGIC, 2, x8h7_pkt_t*)
 #define X8H7_IOCTL_PKT_INIT       _IO   (X8H7_IOCTL_MAGIC, 3)
 #define X8H7_IOCTL_PKT_SYNC_SEND  _IOW  (X8H7_IOCTL_MAGIC, 4, x8h7_pkt_t*)
+#define X8H7_IOCTL_RING_SETUP     _IOW  (X8H7_IOCTL_MAGIC, 5, uint32_t*)
+#define X8H7_IOCTL_PKT_SUBMIT     _IOW  (X8H7_IOCTL_MAGIC, 6, struct x8h7_pkt_vec)
+#define X8H7_IOCTL_TAP_SET        _IOW  (X8H7_IOCTL_MAGIC, 7, uint32_t*)
+
+#define X8H7_IOCTL_MAXNR     7
+
+/**
+ * X8H7_IOCTL_PKT_SUBMIT sends cnt x8h7_pkt_t, up to X8H7_PKT_VEC_MAX,
+ * packed in as few frames as possible; it returns how many were sent.
+ * X8H7_IOCTL_TAP_SET selects the peripherals, bit n for peripheral n,
+ * whose incoming packets are queued for read(), 0 stops it. Each read()
+ * returns whole records, a struct x8h7_pkt_rec followed by size bytes.
+ */
+#define X8H7_PKT_VEC_MAX      64
+
+struct x8h7_pkt_vec {
+  __u64 pkts;         /* user pointer to x8h7_pkt_t[cnt] */
+  __u32 cnt;
+  __u32 flags;        /* must be 0 */
+};
+
+struct x8h7_pkt_rec {
+  __u8  peripheral;
+  __u8  opcode;
+  __u16 size;
+  /* __u8 data[size] */
+};
+
+/**
+ * Debug capture ring of /dev/x8h7_h7.
+ * X8H7_IOCTL_RING_SETUP sets the data size, a power of 2 between
+ * X8H7_RING_SIZE_MIN and X8H7_RING_SIZE_MAX (0 frees the ring), then
+ * the device is mmap'ed with length X8H7_RING_HDR_SIZE + size: the
+ * first page is struct x8h7_ring_hdr, the data area follows.
+ * head and tail are free running byte counts, the kernel only moves
+ * head and the reader only tail. Records are 8 bytes aligned, when
+ * less than a record header is left before the end of the data area
+ * the reader skips to its start, a X8H7_RING_REC_PAD record also says
+ * so. Records that don't fit are dropped, seq keeps counting them.
+ */
+#define X8H7_RING_MAGIC       0x58384837  /* "X8H7" */
+#define X8H7_RING_HDR_SIZE    4096
+#define X8H7_RING_SIZE_MIN    (64 * 1024)
+#define X8H7_RING_SIZE_MAX    (64 * 1024 * 1024)
+
+#define X8H7_RING_REC_PAD     0x0001
+
+struct x8h7_ring_hdr {
+  __u32 magic;
+  __u32 size;         /* data area bytes */
+  __u64 head;         /* written by the kernel */
+  __u64 tail;         /* written by the reader */
+  __u64 dropped;      /* records lost, the ring was full */
+};
+
+struct x8h7_ring_rec {
+  __u32 seq;          /* frame sequence, gaps are drops */
+  __u16 len;          /* data bytes following the record header */
+  __u16 flags;
+  __u64 ts_ns;        /* CLOCK_MONOTONIC when the frame was received */
+  /* __u8 data[len], padded to 8 bytes */
+};
+
+/**
+ * /dev/x8h7_echo link benchmark, needs the H7 echo peripheral.
+ * The kernel runs count packets of size bytes and times them:
+ * - RTT, one echo request at a time, lat_ns optionally receives the
+ *   round trip of each one
+ * - SYNC, x8h7_pkt_send_sync per packet, discarded by the H7
+ * - DEFER, x8h7_pkt_send_defer flushed every batch packets or when the
+ *   frame is full (batch 0), discarded by the H7
+ * - STREAM, echoes batched like DEFER, done when all came back
+ */
+#define X8H7_IOCTL_ECHO_BENCH     _IOWR (X8H7_IOCTL_MAGIC, 8, struct x8h7_echo_bench)
+
+#define X8H7_ECHO_BENCH_RTT       0
+#define X8H7_ECHO_BENCH_SYNC      1
+#define X8H7_ECHO_BENCH_DEFER     2
+#define X8H7_ECHO_BENCH_STREAM    3
+
+#define X8H7_ECHO_SIZE_MIN        8     /* run generation and sequence */
+#define X8H7_ECHO_SIZE_MAX        248   /* X8H7_PKT_SIZE */
+#define X8H7_ECHO_COUNT_MAX       (1024 * 1024)
 
-#define X8H7_IOCTL_MAXNR     4
+struct x8h7_echo_bench {
+  __u32 mode;
+  __u32 count;
+  __u32 size;         /* X8H7_ECHO_SIZE_MIN..X8H7_ECHO_SIZE_MAX */
+  __u32 batch;
+  __u64 lat_ns;       /* user pointer to __u32[count] or 0, RTT only */
+  /* Results */
+  __u64 elapsed_ns;
+  __u64 tx_bytes;     /* payload */
+  __u64 rx_bytes;
+  __u32 errors;       /* lost or corrupted echoes */
+  __u32 reserved;
+};
 
 #endif  /* __X8H7_IOCTL_H */
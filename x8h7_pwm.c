@@ -28,88 +28,73 @@ struct __attribute__((packed, aligned(4))) pwmPacket {
   uint32_t period  : 32;
 };
 
+#define X8H7_PWM_NUM  10
+
 struct x8h7_pwm_chip {
   struct pwm_chip   chip;
-  struct pwmPacket  pkt;
-  wait_queue_head_t wait;
-  int               cnt;
+  struct mutex      lock;
+  /* Last waveform sent to the H7, per channel */
+  struct pwmPacket  pkt[X8H7_PWM_NUM];
+  bool              valid[X8H7_PWM_NUM];
 };
 
 #define to_x8h7_pwm_chip(_chip) container_of(_chip, struct x8h7_pwm_chip, chip)
 
-static int x8h7_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm,
-                           int duty_ns, int period_ns)
+/**
+ * Queue the waveform of a channel in the next frame, skipped when the
+ * H7 already has it. Returns 1 if queued, 0 if unchanged.
+ */
+static int x8h7_pwm_queue(struct x8h7_pwm_chip *x8h7, unsigned int hwpwm,
+                          const struct pwm_state *state)
 {
-  struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
+  struct pwmPacket  pkt = {};
+  int               ret;
 
-  DBG_PRINT("duty_ns: %d, period_ns: %d, enabled: %d\n", duty_ns, period_ns, x8h7->pkt.enable);
   //@TODO: period_ns must be greater than 953
-  x8h7->pkt.duty = duty_ns;
-  x8h7->pkt.period = period_ns;
-  x8h7_pkt_send_sync(X8H7_PWM_PERIPH, pwm->hwpwm, sizeof(x8h7->pkt), &x8h7->pkt);
-
-  return 0;
-}
+  if ((state->period > U32_MAX) || (state->duty_cycle > state->period) ||
+      (state->duty_cycle >= BIT(30))) {
+    return -EINVAL;
+  }
 
+  pkt.enable = state->enabled;
+  pkt.polarity = (state->polarity == PWM_POLARITY_INVERSED);
+  pkt.duty = state->duty_cycle;
+  pkt.period = state->period;
 
-static void x8h7_pwm_hook(void *priv, x8h7_pkt_t *pkt)
-{
-  struct x8h7_pwm_chip  *pwm = (struct x8h7_pwm_chip*)priv;
-  uint8_t           ch;
-
-  ch = pkt->opcode & 0xF;
-  if (ch < 10) {
-    struct pwmPacket* packet = (struct pwmPacket*)(pkt->data);
-    pwm->pkt.duty = packet->duty;
-    pwm->pkt.period = packet->period;
-    pwm->cnt++;
-    wake_up_interruptible(&pwm->wait);
+  if (x8h7->valid[hwpwm] && !memcmp(&pkt, &x8h7->pkt[hwpwm], sizeof(pkt))) {
+    return 0;
   }
-}
 
-static int x8h7_pwm_pkt_get(struct x8h7_pwm_chip *pwm, unsigned int timeout)
-{
-  long ret;
-
-  ret = wait_event_interruptible_timeout(pwm->wait,
-                                         pwm->cnt != 0,
-                                         timeout);
-  if (!ret) {
-    DBG_ERROR("timeout expired");
-    return -1;
+  DBG_PRINT("pwm %d duty_ns: %d, period_ns: %d, enabled: %d\n",
+            hwpwm, pkt.duty, pkt.period, pkt.enable);
+  ret = x8h7_pkt_send_defer(X8H7_PWM_PERIPH, hwpwm, sizeof(pkt), &pkt);
+  if (ret < 0) {
+    /* Frame full, what is queued goes first */
+    x8h7_pkt_send_now();
+    ret = x8h7_pkt_send_defer(X8H7_PWM_PERIPH, hwpwm, sizeof(pkt), &pkt);
+    if (ret < 0) {
+      return ret;
+    }
   }
-  pwm->cnt--;
-  return 0;
+  x8h7->pkt[hwpwm] = pkt;
+  x8h7->valid[hwpwm] = true;
+  return 1;
 }
 
-static int x8h7_pwm_enable(struct pwm_chip *chip, struct pwm_device *pwm)
-{
-  struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
-
-  DBG_PRINT("\n");
-  x8h7->pkt.enable = 1;
-  x8h7_pkt_send_sync(X8H7_PWM_PERIPH, pwm->hwpwm, sizeof(x8h7->pkt), &x8h7->pkt);
-
-  return 0;
-}
-
-static void x8h7_pwm_disable(struct pwm_chip *chip, struct pwm_device *pwm)
+static void x8h7_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm)
 {
   struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
+  struct pwm_state      state;
 
   DBG_PRINT("\n");
-  x8h7->pkt.enable = 0;
-  x8h7_pkt_send_sync(X8H7_PWM_PERIPH, pwm->hwpwm, sizeof(x8h7->pkt), &x8h7->pkt);
-}
-
-static int x8h7_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm)
-{
-    return x8h7_pwm_enable(chip, pwm);
-}
+  pwm_get_state(pwm, &state);
+  state.enabled = false;
 
-static void x8h7_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm)
-{
-    x8h7_pwm_disable(chip, pwm);
+  mutex_lock(&x8h7->lock);
+  if (x8h7_pwm_queue(x8h7, pwm->hwpwm, &state) > 0) {
+    x8h7_pkt_send_now();
+  }
+  mutex_unlock(&x8h7->lock);
 }
 
 static int x8h7_pwm_capture(struct pwm_chip *chip, struct pwm_device *pwm,
@@ -117,17 +102,27 @@ static int x8h7_pwm_capture(struct pwm_chip *chip, struct pwm_device *pwm,
 {
   struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
 
-  //@TODO: period_ns must be greater than 953
-  x8h7_pkt_send_sync(X8H7_PWM_PERIPH, pwm->hwpwm | 0x60, sizeof(x8h7->pkt), &x8h7->pkt);
-
-  x8h7->pkt.duty = 0;
-  x8h7->pkt.period = 0;
+  struct pwmPacket     *packet;
+  x8h7_pkt_t            rsp;
+  struct x8h7_req      *req;
+  int                   ret;
 
-  if (x8h7_pwm_pkt_get(x8h7, timeout) < 0)
-    return -ETIMEDOUT;
+  //@TODO: period_ns must be greater than 953
+  req = x8h7_req_submit(X8H7_PWM_PERIPH, pwm->hwpwm | 0x60,
+                        sizeof(x8h7->pkt[pwm->hwpwm]), &x8h7->pkt[pwm->hwpwm]);
+  if (IS_ERR(req))
+    return PTR_ERR(req);
+  x8h7_pkt_send_now();
+
+  ret = x8h7_req_wait(req, &rsp, msecs_to_jiffies(timeout));
+  if (ret < 0)
+    return ret;
+  if (rsp.size < sizeof(struct pwmPacket))
+    return -EIO;
 
-  result->duty_cycle = x8h7->pkt.duty;
-  result->period = x8h7->pkt.period;
+  packet = (struct pwmPacket*)rsp.data;
+  result->duty_cycle = packet->duty;
+  result->period = packet->period;
 
   DBG_PRINT("duty_ns: %d, period_ns: %d\n", result->duty_cycle, result->period);
 
@@ -137,24 +132,35 @@ static int x8h7_pwm_capture(struct pwm_chip *chip, struct pwm_device *pwm,
 static int x8h7_pwm_apply(struct pwm_chip *chip, struct pwm_device *pwm,
 		                        const struct pwm_state *state)
 {
-  return x8h7_pwm_config(chip, pwm, state->duty_cycle, state->period);
+  struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
+  int                   ret;
+
+  mutex_lock(&x8h7->lock);
+  ret = x8h7_pwm_queue(x8h7, pwm->hwpwm, state);
+  if (ret > 0) {
+    x8h7_pkt_send_now();
+    ret = 0;
+  }
+  mutex_unlock(&x8h7->lock);
+
+  return ret;
 }
 
 static int x8h7_pwm_get_state(struct pwm_chip *chip, struct pwm_device *pwm,
 		                        struct pwm_state *state)
 {
   struct x8h7_pwm_chip *x8h7 = to_x8h7_pwm_chip(chip);
+  struct pwmPacket     *pkt = &x8h7->pkt[pwm->hwpwm];
 
-  state->period = x8h7->pkt.period;
-  state->polarity = x8h7->pkt.polarity;
-  state->duty_cycle = x8h7->pkt.duty;
-  state->enabled = x8h7->pkt.enable;
+  state->period = pkt->period;
+  state->polarity = pkt->polarity ? PWM_POLARITY_INVERSED : PWM_POLARITY_NORMAL;
+  state->duty_cycle = pkt->duty;
+  state->enabled = pkt->enable;
 
   return 0;
 }
 
 static const struct pwm_ops x8h7_pwm_ops = {
-  .request = x8h7_pwm_request,
   .free = x8h7_pwm_free,
   .capture = x8h7_pwm_capture,
   .apply = x8h7_pwm_apply,
@@ -162,6 +168,77 @@ static const struct pwm_ops x8h7_pwm_ops = {
   .owner   = THIS_MODULE,
 };
 
+/**
+ * Update several channels in one frame so they change together.
+ * One "<channel> <period_ns> <duty_ns> <enable> [<inversed>]" per line.
+ * The PWM core state of the channels is not updated.
+ */
+static ssize_t apply_batch_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+  struct x8h7_pwm_chip *x8h7 = dev_get_drvdata(dev);
+  struct pwm_state      state;
+  char                 *lines;
+  char                 *next;
+  char                 *line;
+  unsigned int          hwpwm;
+  unsigned int          period;
+  unsigned int          duty;
+  unsigned int          enable;
+  unsigned int          inversed;
+  int                   queued = 0;
+  int                   ret = 0;
+  int                   n;
+
+  /* Parse line by line, sscanf would take the next line for <inversed> */
+  lines = kstrndup(buf, count, GFP_KERNEL);
+  if (!lines) {
+    return -ENOMEM;
+  }
+  next = lines;
+
+  mutex_lock(&x8h7->lock);
+  while ((line = strsep(&next, "\n")) != NULL) {
+    if (!*line) {
+      continue;
+    }
+    inversed = 0;
+    n = sscanf(line, "%u %u %u %u %u", &hwpwm, &period, &duty, &enable, &inversed);
+    if ((n < 4) || (hwpwm >= X8H7_PWM_NUM)) {
+      ret = -EINVAL;
+      break;
+    }
+    state.period = period;
+    state.duty_cycle = duty;
+    state.enabled = !!enable;
+    state.polarity = inversed ? PWM_POLARITY_INVERSED : PWM_POLARITY_NORMAL;
+    ret = x8h7_pwm_queue(x8h7, hwpwm, &state);
+    if (ret < 0) {
+      break;
+    }
+    queued += ret;
+  }
+  /* Lines before an invalid one still go out */
+  if (queued) {
+    x8h7_pkt_send_now();
+  }
+  mutex_unlock(&x8h7->lock);
+  kfree(lines);
+
+  return (ret < 0) ? ret : count;
+}
+static DEVICE_ATTR_WO(apply_batch);
+
+static struct attribute *x8h7_pwm_attrs[] = {
+  &dev_attr_apply_batch.attr,
+  NULL,
+};
+
+static const struct attribute_group x8h7_pwm_group = {
+  .attrs = x8h7_pwm_attrs,
+};
+
 static const struct of_device_id x8h7_pwm_dt_ids[] = {
   { .compatible = "portenta,x8h7_pwm", },
   { /* sentinel */ },
@@ -181,9 +258,8 @@ static int x8h7_pwm_probe(struct platform_device *pdev)
   x8h7_pwm->chip.dev  = &pdev->dev;
   x8h7_pwm->chip.ops  = &x8h7_pwm_ops;
   x8h7_pwm->chip.base = -1;
-  x8h7_pwm->chip.npwm = 10;
-
-  init_waitqueue_head(&x8h7_pwm->wait);
+  x8h7_pwm->chip.npwm = X8H7_PWM_NUM;
+  mutex_init(&x8h7_pwm->lock);
 
   ret = pwmchip_add(&x8h7_pwm->chip);
   if (ret < 0) {
@@ -193,9 +269,14 @@ static int x8h7_pwm_probe(struct platform_device *pdev)
 
   platform_set_drvdata(pdev, x8h7_pwm);
 
-  x8h7_hook_set(X8H7_PWM_PERIPH, x8h7_pwm_hook, x8h7_pwm);
+  ret = devm_device_add_group(&pdev->dev, &x8h7_pwm_group);
+  if (ret < 0) {
+    dev_err(&pdev->dev, "failed to add sysfs group %d\n", ret);
+    pwmchip_remove(&x8h7_pwm->chip);
+    return ret;
+  }
 
-  return ret;
+  return 0;
 }
 
 static int x8h7_pwm_remove(struct platform_device *pdev)
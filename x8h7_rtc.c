@@ -4,12 +4,14 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
 #include <linux/slab.h>
-#include <linux/wait.h>
 
 #include "x8h7.h"
 
@@ -29,74 +31,100 @@
 #define X8H7_RTC_ALARM_IEN  0x13
 #define X8H7_RTC_ALARM_INT  0x14
 
+/* Seconds a cached H7 time is extrapolated before reading it again, 0 always reads */
+static unsigned int resync_sec = 600;
+module_param(resync_sec, uint, 0644);
+MODULE_PARM_DESC(resync_sec, "Seconds between H7 RTC reads, 0 reads on every call");
+
 struct x8h7_rtc {
   struct rtc_device  *rtc;
   int                 alarm_enabled;
   int                 alarm_pending;
-  wait_queue_head_t   wait;
-  int                 rx_cnt;
-  x8h7_pkt_t          rx_pkt;
+
+  /* H7 time at cache_ts, extrapolated with CLOCK_BOOTTIME which also
+   * runs in suspend like the H7 RTC does.
+   */
+  struct mutex        lock;
+  bool                cache_valid;
+  time64_t            cache_secs;
+  ktime_t             cache_ts;
 };
 
-static void x8h7_rtc_hook(void *priv, x8h7_pkt_t *pkt)
+static void x8h7_rtc_hook(void *priv, uint8_t opcode, const uint8_t *data,
+                          uint16_t size)
 {
   struct x8h7_rtc  *rtc = (struct x8h7_rtc*)priv;
 
-  if ((pkt->peripheral == X8H7_RTC_PERIPH) &&
-      (pkt->opcode == X8H7_RTC_ALARM_INT) &&
-      (pkt->size == 1)) {
+  if ((opcode == X8H7_RTC_ALARM_INT) && (size == 1)) {
+    /* The H7 may have acted on its clock, read it again next time */
+    WRITE_ONCE(rtc->cache_valid, false);
     rtc->alarm_pending = 1;
     rtc_update_irq(rtc->rtc, 1, RTC_IRQF | RTC_AF);
-  } else {
-    memcpy(&rtc->rx_pkt, pkt, sizeof(x8h7_pkt_t));
-    rtc->rx_cnt++;
-    wake_up_interruptible(&rtc->wait);
   }
 }
 
-static int x8h7_rtc_pkt_get(struct x8h7_rtc *rtc)
+static int x8h7_rtc_get_date(struct rtc_time *tm)
 {
-  long ret;
-
-  ret = wait_event_interruptible_timeout(rtc->wait,
-                                         rtc->rx_cnt != 0,
-                                         X8H7_RX_TIMEOUT);
-  if (!ret) {
-    DBG_ERROR("timeout expired");
-    return -1;
+  x8h7_pkt_t  rsp;
+  int         ret;
+
+  ret = x8h7_pkt_send_recv(X8H7_RTC_PERIPH, X8H7_RTC_GET_DATE, 0, NULL, &rsp);
+  if (ret < 0)
+    return ret;
+
+  if (rsp.size != 7) {
+    DBG_ERROR("Invalid response\n");
+    return -EIO;
   }
-  rtc->rx_cnt--;
-  return 0;
+  tm->tm_sec  = rsp.data[0x00];
+  tm->tm_min  = rsp.data[0x01];
+  tm->tm_hour = rsp.data[0x02];
+  tm->tm_mday = rsp.data[0x03];
+  tm->tm_mon  = rsp.data[0x04];
+  tm->tm_year = rsp.data[0x05] + 100;
+  tm->tm_wday = rsp.data[0x06];
+  return rtc_valid_tm(tm);
 }
 
+/**
+ * Served from the cache without SPI traffic until resync_sec elapsed.
+ * The H7 reports whole seconds, so the cached time may lag by up to one.
+ */
 static int x8h7_rtc_read_time(struct device *dev, struct rtc_time *tm)
 {
-  struct x8h7_rtc *rtc = dev_get_drvdata(dev);
+  struct x8h7_rtc  *rtc = dev_get_drvdata(dev);
+  ktime_t           now;
+  s64               elapsed;
+  int               ret = 0;
 
   DBG_PRINT("\n");
-  x8h7_pkt_send_sync(X8H7_RTC_PERIPH, X8H7_RTC_GET_DATE, 0, NULL);
-  if (x8h7_rtc_pkt_get(rtc) < 0)
-    return -ETIMEDOUT;
-
-  if ((rtc->rx_pkt.peripheral == X8H7_RTC_PERIPH) &&
-      (rtc->rx_pkt.opcode == X8H7_RTC_GET_DATE) &&
-      (rtc->rx_pkt.size == 7)) {
-    tm->tm_sec  = rtc->rx_pkt.data[0x00];
-    tm->tm_min  = rtc->rx_pkt.data[0x01];
-    tm->tm_hour = rtc->rx_pkt.data[0x02];
-    tm->tm_mday = rtc->rx_pkt.data[0x03];
-    tm->tm_mon  = rtc->rx_pkt.data[0x04];
-    tm->tm_year = rtc->rx_pkt.data[0x05] + 100;
-    tm->tm_wday = rtc->rx_pkt.data[0x06];
-  } else {
-    DBG_ERROR("Invalid response\n");
+  mutex_lock(&rtc->lock);
+  now = ktime_get_boottime();
+  elapsed = ktime_to_ns(ktime_sub(now, rtc->cache_ts));
+  if (READ_ONCE(rtc->cache_valid) && resync_sec &&
+      (elapsed < (s64)resync_sec * NSEC_PER_SEC)) {
+    rtc_time64_to_tm(rtc->cache_secs + div_s64(elapsed, NSEC_PER_SEC), tm);
+    goto out;
   }
-  return 0;
+
+  ret = x8h7_rtc_get_date(tm);
+  if (ret < 0) {
+    WRITE_ONCE(rtc->cache_valid, false);
+    goto out;
+  }
+  rtc->cache_secs = rtc_tm_to_time64(tm);
+  rtc->cache_ts = now;
+  WRITE_ONCE(rtc->cache_valid, true);
+out:
+  mutex_unlock(&rtc->lock);
+  return ret;
 }
 
 static int x8h7_rtc_set_time(struct device *dev, struct rtc_time *tm)
 {
-  uint8_t   data[7];
+  struct x8h7_rtc  *rtc = dev_get_drvdata(dev);
+  uint8_t           data[7];
+  int               ret;
 
   DBG_PRINT("%02d:%02d:%02d %d/%d/%d\n",
             tm->tm_hour, tm->tm_min, tm->tm_sec,
@@ -110,9 +138,13 @@ static int x8h7_rtc_set_time(struct device *dev, struct rtc_time *tm)
   data[0x05] = tm->tm_year - 100;
   data[0x06] = tm->tm_wday;
 
-  x8h7_pkt_send_sync(X8H7_RTC_PERIPH, X8H7_RTC_SET_DATE, 7, data);
+  mutex_lock(&rtc->lock);
+  ret = x8h7_pkt_send_sync(X8H7_RTC_PERIPH, X8H7_RTC_SET_DATE, 7, data);
+  /* Even on error, the H7 may have taken it */
+  WRITE_ONCE(rtc->cache_valid, false);
+  mutex_unlock(&rtc->lock);
 
-  return 0;
+  return (ret < 0) ? ret : 0;
 }
 
 /*
@@ -125,26 +157,26 @@ struct rtc_wkalrm {
 int x8h7_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *wa)
 {
   struct x8h7_rtc *rtc = dev_get_drvdata(dev);
+  x8h7_pkt_t       rsp;
+  int              ret;
 
   DBG_PRINT("\n");
 
   wa->enabled = rtc->alarm_enabled;
   wa->pending = rtc->alarm_pending;
 
-  x8h7_pkt_send_sync(X8H7_RTC_PERIPH, X8H7_RTC_GET_ALARM, 0, NULL);
-  if (x8h7_rtc_pkt_get(rtc) < 0)
-    return -ETIMEDOUT;
-
-  if ((rtc->rx_pkt.peripheral == X8H7_RTC_PERIPH) &&
-      (rtc->rx_pkt.opcode == X8H7_RTC_GET_ALARM) &&
-      (rtc->rx_pkt.size == 7)) {
-    wa->time.tm_sec  = rtc->rx_pkt.data[0x00];
-    wa->time.tm_min  = rtc->rx_pkt.data[0x01];
-    wa->time.tm_hour = rtc->rx_pkt.data[0x02];
-    wa->time.tm_mday = rtc->rx_pkt.data[0x03];
-    wa->time.tm_mon  = rtc->rx_pkt.data[0x04];
-    wa->time.tm_year = rtc->rx_pkt.data[0x05] + 100;
-    wa->time.tm_wday = rtc->rx_pkt.data[0x06];
+  ret = x8h7_pkt_send_recv(X8H7_RTC_PERIPH, X8H7_RTC_GET_ALARM, 0, NULL, &rsp);
+  if (ret < 0)
+    return ret;
+
+  if (rsp.size == 7) {
+    wa->time.tm_sec  = rsp.data[0x00];
+    wa->time.tm_min  = rsp.data[0x01];
+    wa->time.tm_hour = rsp.data[0x02];
+    wa->time.tm_mday = rsp.data[0x03];
+    wa->time.tm_mon  = rsp.data[0x04];
+    wa->time.tm_year = rsp.data[0x05] + 100;
+    wa->time.tm_wday = rsp.data[0x06];
   } else {
     DBG_ERROR("Invalid response\n");
   }
@@ -213,8 +245,7 @@ static int x8h7_rtc_probe(struct platform_device *pdev)
     goto out;
   }
 
-  init_waitqueue_head(&p->wait);
-
+  mutex_init(&p->lock);
   platform_set_drvdata(pdev, p);
 
   p->rtc = devm_rtc_device_register(&pdev->dev, DEVICE_NAME,
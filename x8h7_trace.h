@@ -0,0 +1,97 @@
+/**
+ * X8H7 packet path tracepoints
+ * Timestamps are the ones of the trace buffer, enable with e.g.
+ * trace-cmd record -e x8h7
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM x8h7
+
+#if !defined(__X8H7_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __X8H7_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(x8h7_pkt_enq,
+  TP_PROTO(uint8_t peripheral, uint8_t opcode, uint16_t size, uint16_t frame),
+  TP_ARGS(peripheral, opcode, size, frame),
+  TP_STRUCT__entry(
+    __field(uint8_t,  peripheral)
+    __field(uint8_t,  opcode)
+    __field(uint16_t, size)
+    __field(uint16_t, frame)
+  ),
+  TP_fast_assign(
+    __entry->peripheral = peripheral;
+    __entry->opcode     = opcode;
+    __entry->size       = size;
+    __entry->frame      = frame;
+  ),
+  TP_printk("periph=%02x opcode=%02x size=%u frame=%u",
+            __entry->peripheral, __entry->opcode, __entry->size, __entry->frame)
+);
+
+TRACE_EVENT(x8h7_spi_trx_start,
+  TP_PROTO(unsigned int len),
+  TP_ARGS(len),
+  TP_STRUCT__entry(
+    __field(unsigned int, len)
+  ),
+  TP_fast_assign(
+    __entry->len = len;
+  ),
+  TP_printk("len=%u", __entry->len)
+);
+
+TRACE_EVENT(x8h7_spi_trx_end,
+  TP_PROTO(unsigned int len, int ret),
+  TP_ARGS(len, ret),
+  TP_STRUCT__entry(
+    __field(unsigned int, len)
+    __field(int,          ret)
+  ),
+  TP_fast_assign(
+    __entry->len = len;
+    __entry->ret = ret;
+  ),
+  TP_printk("len=%u ret=%d", __entry->len, __entry->ret)
+);
+
+TRACE_EVENT(x8h7_pkt_dispatch,
+  TP_PROTO(uint8_t peripheral, uint8_t opcode, uint16_t size, bool reply),
+  TP_ARGS(peripheral, opcode, size, reply),
+  TP_STRUCT__entry(
+    __field(uint8_t,  peripheral)
+    __field(uint8_t,  opcode)
+    __field(uint16_t, size)
+    __field(bool,     reply)
+  ),
+  TP_fast_assign(
+    __entry->peripheral = peripheral;
+    __entry->opcode     = opcode;
+    __entry->size       = size;
+    __entry->reply      = reply;
+  ),
+  TP_printk("periph=%02x opcode=%02x size=%u to=%s",
+            __entry->peripheral, __entry->opcode, __entry->size,
+            __entry->reply ? "request" : "hook")
+);
+
+TRACE_EVENT(x8h7_irq,
+  TP_PROTO(int irq),
+  TP_ARGS(irq),
+  TP_STRUCT__entry(
+    __field(int, irq)
+  ),
+  TP_fast_assign(
+    __entry->irq = irq;
+  ),
+  TP_printk("irq=%d", __entry->irq)
+);
+
+#endif /* __X8H7_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE x8h7_trace
+#include <trace/define_trace.h>
@@ -14,8 +14,11 @@
 #include <linux/tty_flip.h>
 #include <linux/serial_core.h>
 #include <linux/serial.h>
+#include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/uio.h>
+#include <linux/kfifo.h>
 #include <asm/io.h>
 #include <asm/irq.h>
 
@@ -32,12 +35,12 @@
 #define X8H7_UART_BAUD_MIN          0
 #define X8H7_UART_BAUD_MAX    2000000
 
-// Peripheral code
+// Peripheral code of the first port, the others set "peripheral-id"
 #define X8H7_UART_PERIPH 0x05
 
 // Op code
 #define X8H7_UART_OC_CONFIGURE      0x10 // BAUD | DATA_MODE 2 byte
-#define X8H7_UART_OC_GET_LINESTATE  0x20 // 2 byte
+#define X8H7_UART_OC_GET_LINESTATE  0x20 // 2 byte, control to H7 and line state from H7
 #define X8H7_UART_OC_DATA           0x01 // variable
 #define X8H7_UART_OC_STATUS         0x02 // received uart status e.g. busy state
 
@@ -97,11 +100,18 @@ struct __attribute__((packed, aligned(4))) uartPacket {
 #define X8H7_UART_MAJOR   204
 #define MINOR_START         5
 
-#define X8H7_UART_NR_PORTS  1
+#define X8H7_UART_NR_PORTS  4
 
+/* Received bytes waiting for tty insertion, must be a power of 2 */
+#define X8H7_UART_RX_FIFO_SIZE  4096
 
-#define X8H7_UART_CFG_SEND  0x00000001
-#define X8H7_UART_TRANSMIT  0x00000002
+
+/* Work requests, bit numbers of flags set by the uart ops and cleared
+ * by the work, always with atomic bitops as they run concurrently
+ */
+#define X8H7_UART_CFG_SEND  0
+#define X8H7_UART_TRANSMIT  1
+#define X8H7_UART_CTRL_SEND 2
 
 /*
  * This determines how often we check the modem status signals
@@ -119,72 +129,142 @@ struct x8h7_uart_port {
   /* Low level I/O work */
   struct work_struct        work;
   struct workqueue_struct  *workqueue;
-  uint32_t                  flags;
+  unsigned long             flags;
 
   struct uartPacket         cfg;
+  uint16_t                  control;
 
   /* X8H7 */
-  wait_queue_head_t         wait;
-  int                       rx_cnt;
-  x8h7_pkt_t                rx_pkt;
+  int                       periph;
   uint8_t                   status; // used to handle busy tx and other stuff
+  bool                      status_valid;
+  unsigned int              mctrl;  // modem lines pushed by the H7
+  bool                      mctrl_valid;
+
+  /* Rx ring filled by the hook, emptied by rx_work: single producer and consumer */
+  struct work_struct        rx_work;
+  DECLARE_KFIFO(rx_fifo, uint8_t, X8H7_UART_RX_FIFO_SIZE);
 };
 
-struct x8h7_uart_port x8h7_uart_ports[X8H7_UART_NR_PORTS];
+static struct x8h7_uart_port *x8h7_uart_ports[X8H7_UART_NR_PORTS];
+static DEFINE_MUTEX(x8h7_uart_ports_lock);
 
 static void x8h7_uart_stop_tx(struct uart_port *port);
 static void x8h7_uart_mctrl_check(struct x8h7_uart_port *sport);
+static void x8h7_uart_linestate(struct x8h7_uart_port *sport, uint16_t state);
 static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport);
 static void x8h7_uart_tx_chars(struct x8h7_uart_port *sport);
 
 
 /**
+ * Line state pushed by the H7, modem line changes are handled at once
  */
-static void x8h7_uart_hook(void *priv, x8h7_pkt_t *pkt)
+static void x8h7_uart_linestate(struct x8h7_uart_port *sport, uint16_t state)
 {
-  struct x8h7_uart_port  *sport = (struct x8h7_uart_port*)priv;
+  unsigned long  flags;
+  unsigned int   mctrl = 0;
+
+  if (state & X8H7_UART_CTRL_CTS) {
+    mctrl |= TIOCM_CTS;
+  }
+  if (state & X8H7_UART_CTRL_DSR) {
+    mctrl |= TIOCM_DSR;
+  }
+  if (state & X8H7_UART_CTRL_DCD) {
+    mctrl |= TIOCM_CAR;
+  }
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->mctrl = mctrl;
+  sport->mctrl_valid = true;
+  x8h7_uart_mctrl_check(sport);
+  spin_unlock_irqrestore(&sport->port.lock, flags);
 
-  memcpy(&sport->rx_pkt, pkt, sizeof(x8h7_pkt_t));
+  wake_up_interruptible(&sport->port.state->port.delta_msr_wait);
+}
+
+/**
+ * Runs in the SPI thread, data is just queued for rx_work
+ */
+static void x8h7_uart_hook(void *priv, uint8_t opcode, const uint8_t *data,
+                           uint16_t size)
+{
+  struct x8h7_uart_port  *sport = (struct x8h7_uart_port*)priv;
+  unsigned int            len;
 
-  switch(sport->rx_pkt.opcode) {
+  switch(opcode) {
   case X8H7_UART_OC_DATA:
     /* Byte or break signal received */
-    x8h7_uart_rx_chars(sport);
+    len = kfifo_in(&sport->rx_fifo, data, size);
+    if (len < size) {
+      sport->port.icount.overrun += size - len;
+    }
+    queue_work(sport->workqueue, &sport->rx_work);
     break;
   case X8H7_UART_OC_STATUS:
-    sport->status = sport->rx_pkt.data[0]; // @TODO: implement this on H7 side
+    if (size >= 1) {
+      sport->status = data[0];
+      sport->status_valid = true;
+    }
+    break;
+  case X8H7_UART_OC_GET_LINESTATE:
+    if (size >= 2) {
+      x8h7_uart_linestate(sport, data[0] | (data[1] << 8));
+    }
     break;
   }
-
-  sport->rx_cnt++;
 }
 
 /**
+ * Move received bytes to the tty, a block at a time unless
+ * a sysrq sequence is in progress
  */
 static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport)
 {
-  unsigned int  ch;
-  int           i;
-  int           ret;
-
-  DBG_PRINT("size: %d\n", sport->rx_pkt.size);
-  for (i=0 ; i<sport->rx_pkt.size; i++) {
-    ch = sport->rx_pkt.data[0 + i];
-    ret = uart_handle_sysrq_char(&sport->port, ch);
-    if (!ret) {
-      // @TODO: fix parameters
-      unsigned int status = 0;
-      unsigned int overrun = 0;
-      unsigned int flg = TTY_NORMAL;
-      DBG_PRINT("add char '%c'\n", ch);
-      uart_insert_char(&sport->port, status, overrun, ch, flg);
-      sport->port.icount.rx++;
+  struct tty_port  *tport = &sport->port.state->port;
+  uint8_t           buf[256];
+  unsigned int      len;
+  int               copied;
+
+  while ((len = kfifo_out(&sport->rx_fifo, buf, sizeof(buf))) > 0) {
+    DBG_PRINT("size: %d\n", len);
+#ifdef CONFIG_MAGIC_SYSRQ_SERIAL
+    if (sport->port.sysrq) {
+      unsigned int  ch;
+      int           i;
+
+      for (i = 0; i < len; i++) {
+        ch = buf[i];
+        if (!uart_handle_sysrq_char(&sport->port, ch)) {
+          // @TODO: fix parameters
+          unsigned int status = 0;
+          unsigned int overrun = 0;
+          unsigned int flg = TTY_NORMAL;
+          DBG_PRINT("add char '%c'\n", ch);
+          uart_insert_char(&sport->port, status, overrun, ch, flg);
+          sport->port.icount.rx++;
+        }
+      }
+      continue;
+    }
+#endif
+    copied = tty_insert_flip_string(tport, buf, len);
+    sport->port.icount.rx += copied;
+    if (copied < len) {
+      sport->port.icount.buf_overrun += len - copied;
     }
   }
 
-  //spin_unlock(&sport->port.lock);
-  tty_flip_buffer_push(&sport->port.state->port);
-  //spin_lock(&sport->port.lock);
+  tty_flip_buffer_push(tport);
+}
+
+/**
+ */
+static void x8h7_uart_rx_work_func(struct work_struct *work)
+{
+  struct x8h7_uart_port *sport = container_of(work, struct x8h7_uart_port, rx_work);
+
+  x8h7_uart_rx_chars(sport);
 }
 
 /**
@@ -219,7 +299,7 @@ static void x8h7_uart_tx_chars(struct x8h7_uart_port *sport)
   /*
    * TX while bytes available
    */
-  sport->flags |= X8H7_UART_TRANSMIT;
+  set_bit(X8H7_UART_TRANSMIT, &sport->flags);
   DBG_PRINT("work queue triggered\n");
   queue_work(sport->workqueue, &sport->work);
 }
@@ -272,23 +352,28 @@ static void x8h7_uart_stop_rx(struct uart_port *port)
 
 /**
  * Return TIOCSER_TEMT when transmitter is not busy.
- * @TODO: need to understand when H7 is still busy
- * in trasmitting data on uart due to slower throughput in
- * comparison with spi. Introduce status byte?
+ * The H7 pushes X8H7_UART_OC_STATUS when its transmitter state
+ * changes, until the first one is received only our side is known.
  */
 static unsigned int x8h7_uart_tx_empty(struct uart_port *port)
 {
   struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
-  DBG_PRINT("Tx empty : %x\n", sport->flags);
-  queue_work(sport->workqueue, &sport->work);
-  return ((sport->flags & X8H7_UART_TRANSMIT) ? 0 : TIOCSER_TEMT);
+
+  DBG_PRINT("Tx empty : %lx status %x\n", sport->flags, sport->status);
+  if (test_bit(X8H7_UART_TRANSMIT, &sport->flags)) {
+    return 0;
+  }
+  if (sport->status_valid && !(sport->status & X8H7_UART_STATUS_TX_EMPTY)) {
+    return 0;
+  }
+  return TIOCSER_TEMT;
 }
 
 /**
  */
 static void x8h7_uart_set_mctrl(struct uart_port *port, unsigned int mctrl)
 {
-//struct x8h7_uart_port  *sport = (struct x8h7_uart_port *)port;
+  struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
   uint16_t                control;
 
   DBG_PRINT("x8h7_uart_set_mctrl\n");
@@ -303,17 +388,25 @@ static void x8h7_uart_set_mctrl(struct uart_port *port, unsigned int mctrl)
   if (mctrl & TIOCM_DTR) {
     control |= X8H7_UART_CTRL_DTR;
   }
-//@TODO: tolto per BUG: scheduling while atomic: insmod/573/0x00000002 trovare un sistema
-  //x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_GET_LINESTATE, 2, &control);
+  /* Called with port lock held, the work sends it */
+  sport->control = control;
+  set_bit(X8H7_UART_CTRL_SEND, &sport->flags);
+  if (sport->workqueue) {
+    queue_work(sport->workqueue, &sport->work);
+  }
 }
 
 /**
  */
 static unsigned int x8h7_uart_get_mctrl(struct uart_port *port)
 {
-  /* DCD and DSR are not wired and CTS/RTS is handled automatically
-  * so just indicate DSR and CAR asserted
-  * @TODO: add also TIOCM_CTS?
+  struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
+
+  if (sport->mctrl_valid) {
+    return sport->mctrl;
+  }
+  /* Until the H7 reports the line state, CTS/RTS is handled
+  * automatically so just indicate DSR and CAR asserted
   */
   return TIOCM_DSR | TIOCM_CAR;
 }
@@ -358,8 +451,8 @@ static int x8h7_uart_request_port(struct uart_port *port)
   struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
 
   DBG_PRINT("\n");
-  x8h7_hook_set(X8H7_UART_PERIPH, x8h7_uart_hook, sport);
-  return 0;
+  kfifo_reset(&sport->rx_fifo);
+  return x8h7_hook_set(sport->periph, x8h7_uart_hook, sport);
 }
 
 /**
@@ -367,8 +460,10 @@ static int x8h7_uart_request_port(struct uart_port *port)
  */
 static void x8h7_uart_release_port(struct uart_port *port)
 {
+  struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
+
   DBG_PRINT("\n");
-  x8h7_hook_set(X8H7_UART_PERIPH, NULL, NULL);
+  x8h7_hook_set(sport->periph, NULL, NULL);
 }
 
 /**
@@ -401,6 +496,7 @@ static void x8h7_uart_shutdown(struct uart_port *port)
 
   DBG_PRINT("\n");
   x8h7_uart_release_port(port);
+  cancel_work_sync(&sport->rx_work);
   sport->port.type = 150;
   /*
    * Disable all interrupts
@@ -498,7 +594,7 @@ static void x8h7_uart_set_termios(struct uart_port *port,
    * then, disable everything
    * Reset the Rx and Tx FIFOs too
    */
-  sport->flags |= X8H7_UART_CFG_SEND;
+  set_bit(X8H7_UART_CFG_SEND, &sport->flags);
   DBG_PRINT("work queue triggered\n");
   queue_work(sport->workqueue, &sport->work);
 
@@ -592,83 +688,198 @@ static void x8h7_uart_work_func(struct work_struct *work)
   struct x8h7_uart_port *sport = container_of(work, struct x8h7_uart_port, work);
 
   DBG_PRINT("work queue start\n");
-  DBG_PRINT("FLAGS %08X\n", sport->flags);
+  DBG_PRINT("FLAGS %08lX\n", sport->flags);
 
-  if (sport->flags & X8H7_UART_CFG_SEND) {
-    sport->flags &= ~X8H7_UART_CFG_SEND;
-    x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_CONFIGURE,
+  if (test_and_clear_bit(X8H7_UART_CFG_SEND, &sport->flags)) {
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_CONFIGURE,
                        sizeof(sport->cfg), &sport->cfg);
   }
-  if (sport->flags & X8H7_UART_TRANSMIT) {
+  if (test_and_clear_bit(X8H7_UART_CTRL_SEND, &sport->flags)) {
+    unsigned long  flags;
+    uint16_t       control;
+
+    /* set_mctrl updates it under the port lock */
+    spin_lock_irqsave(&sport->port.lock, flags);
+    control = sport->control;
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_GET_LINESTATE,
+                       sizeof(control), &control);
+  }
+  if (test_and_clear_bit(X8H7_UART_TRANSMIT, &sport->flags)) {
     struct circ_buf  *xmit = &sport->port.state->xmit;
-    uint8_t           txb[X8H7_PKT_SIZE];
-    uint16_t          size;
-
-    sport->flags &= ~X8H7_UART_TRANSMIT;
-
-    while (!uart_circ_empty(xmit)) {
-
-      for (size = 0; size < X8H7_PKT_SIZE && !uart_circ_empty(xmit); size++) {
-        txb[size] = xmit->buf[xmit->tail];
-
-        xmit->tail = (xmit->tail + 1) & (UART_XMIT_SIZE - 1);
+    struct kvec       iov[2];
+    unsigned long     flags;
+    unsigned int      size;
+    int               ret;
+
+    for (;;) {
+      spin_lock_irqsave(&sport->port.lock, flags);
+      size = uart_circ_chars_pending(xmit);
+      if (!size) {
+        spin_unlock_irqrestore(&sport->port.lock, flags);
+        break;
       }
+      size = min_t(unsigned int, size, X8H7_PKT_SIZE);
+      size = min_t(unsigned int, size, x8h7_pkt_room());
+      ret = -ENOMEM;
+      if (size) {
+        /* At most two spans, the second one when the buffer wraps */
+        iov[0].iov_base = xmit->buf + xmit->tail;
+        iov[0].iov_len  = min_t(unsigned int, size,
+                                CIRC_CNT_TO_END(xmit->head, xmit->tail, UART_XMIT_SIZE));
+        iov[1].iov_base = xmit->buf;
+        iov[1].iov_len  = size - iov[0].iov_len;
+        ret = x8h7_pkt_send_defer_v(sport->periph, X8H7_UART_OC_DATA, iov,
+                                    iov[1].iov_len ? 2 : 1);
+      }
+      if (!ret) {
+        xmit->tail = (xmit->tail + size) & (UART_XMIT_SIZE - 1);
+        sport->port.icount.tx += size;
+        if (uart_circ_chars_pending(xmit) < WAKEUP_CHARS) {
+          uart_write_wakeup(&sport->port);
+        }
+      }
+      spin_unlock_irqrestore(&sport->port.lock, flags);
 
-      //send pkt
-      x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_DATA, size, txb);
-
-      sport->port.icount.tx += size;
+      if (ret == -ENOMEM) {
+        /* Frame is full, send it and go on with the next one */
+        x8h7_pkt_send_now();
+      } else if (ret < 0) {
+        break;
+      }
     }
-    //uart_circ_clear(xmit);
+    /* Data shares the frame with pending packets of other peripherals */
+    x8h7_pkt_send_now();
   }
   DBG_PRINT("work queue end\n");
 }
 
 /**
+ * One platform device per H7 UART, "peripheral-id" addresses it on
+ * the SPI link and "line" selects the ttyX index (first free if unset).
  */
 static int x8h7_uart_probe(struct platform_device *pdev)
 {
-  int i = 0;
-
-  init_waitqueue_head(&x8h7_uart_ports[i].wait);
-
-  x8h7_uart_ports[i].port.type     = 150;
-  x8h7_uart_ports[i].port.fifosize = 32;
-  x8h7_uart_ports[i].port.flags    = 0;
-  x8h7_uart_ports[i].port.iotype   = SERIAL_IO_PORT;
-  x8h7_uart_ports[i].port.iobase   = 0;
-  x8h7_uart_ports[i].port.membase  = (void __iomem *)~0;
-  x8h7_uart_ports[i].port.uartclk  = 24*1000*1000;
-  x8h7_uart_ports[i].port.ops      = &x8h7_uart_pops;
-
-  x8h7_uart_ports[i].port.line = 0;
-  x8h7_uart_ports[i].port.dev  = &pdev->dev;
-  x8h7_uart_ports[i].port.irq  = 0;
-
-  uart_add_one_port(&x8h7_uart, &x8h7_uart_ports[i].port);
-  platform_set_drvdata(pdev, &x8h7_uart_ports[i]);
-  x8h7_hook_set(X8H7_UART_PERIPH, x8h7_uart_hook, &x8h7_uart_ports[i]);
-
-  INIT_WORK(&x8h7_uart_ports[i].work, x8h7_uart_work_func);
-  x8h7_uart_ports[i].workqueue = create_workqueue("x8h7_uart_work");
-  if (!x8h7_uart_ports[i].workqueue) {
-    DBG_ERROR("fail to create work queue\n");
+  struct device_node     *node = pdev->dev.of_node;
+  struct x8h7_uart_port  *sport;
+  uint32_t                line;
+  uint32_t                periph;
+  int                     ret;
+
+  sport = devm_kzalloc(&pdev->dev, sizeof(*sport), GFP_KERNEL);
+  if (!sport) {
     return -ENOMEM;
   }
 
-  DBG_PRINT("probed\n");
+  mutex_lock(&x8h7_uart_ports_lock);
+  if (of_property_read_u32(node, "line", &line)) {
+    for (line = 0; line < X8H7_UART_NR_PORTS; line++) {
+      if (!x8h7_uart_ports[line]) {
+        break;
+      }
+    }
+  }
+  if ((line >= X8H7_UART_NR_PORTS) || x8h7_uart_ports[line]) {
+    mutex_unlock(&x8h7_uart_ports_lock);
+    dev_err(&pdev->dev, "no free uart line\n");
+    return -EBUSY;
+  }
+  x8h7_uart_ports[line] = sport;
+  mutex_unlock(&x8h7_uart_ports_lock);
+
+  if (of_property_read_u32(node, "peripheral-id", &periph)) {
+    if (line) {
+      dev_err(&pdev->dev, "peripheral-id required for line %d\n", line);
+      ret = -EINVAL;
+      goto out_line;
+    }
+    periph = X8H7_UART_PERIPH;
+  }
+  if (!periph || (periph >= X8H7_PERIPH_NUM)) {
+    dev_err(&pdev->dev, "invalid peripheral-id %u\n", periph);
+    ret = -EINVAL;
+    goto out_line;
+  }
+  /* Other peripherals are caught when hooking it */
+  mutex_lock(&x8h7_uart_ports_lock);
+  for (ret = 0; ret < X8H7_UART_NR_PORTS; ret++) {
+    if (x8h7_uart_ports[ret] && (x8h7_uart_ports[ret] != sport) &&
+        (x8h7_uart_ports[ret]->periph == periph)) {
+      break;
+    }
+  }
+  if (ret < X8H7_UART_NR_PORTS) {
+    mutex_unlock(&x8h7_uart_ports_lock);
+    dev_err(&pdev->dev, "peripheral-id %u already used by line %d\n", periph, ret);
+    ret = -EBUSY;
+    goto out_line;
+  }
+  sport->periph = periph;
+  mutex_unlock(&x8h7_uart_ports_lock);
+
+  INIT_KFIFO(sport->rx_fifo);
+  INIT_WORK(&sport->rx_work, x8h7_uart_rx_work_func);
+  INIT_WORK(&sport->work, x8h7_uart_work_func);
+  sport->workqueue = alloc_ordered_workqueue("x8h7_uart%d", WQ_MEM_RECLAIM, line);
+  if (!sport->workqueue) {
+    DBG_ERROR("fail to create work queue\n");
+    ret = -ENOMEM;
+    goto out_line;
+  }
+
+  sport->port.type     = 150;
+  sport->port.fifosize = 32;
+  sport->port.flags    = 0;
+  sport->port.iotype   = SERIAL_IO_PORT;
+  sport->port.iobase   = 0;
+  sport->port.membase  = (void __iomem *)~0;
+  sport->port.uartclk  = 24*1000*1000;
+  sport->port.ops      = &x8h7_uart_pops;
+
+  sport->port.line = line;
+  sport->port.dev  = &pdev->dev;
+  sport->port.irq  = 0;
+
+  ret = uart_add_one_port(&x8h7_uart, &sport->port);
+  if (ret) {
+    DBG_ERROR("fail to add uart port\n");
+    goto out_wq;
+  }
+  platform_set_drvdata(pdev, sport);
+
+  /* The hook queues rx_work, it needs the workqueue */
+  ret = x8h7_hook_set(sport->periph, x8h7_uart_hook, sport);
+  if (ret < 0) {
+    dev_err(&pdev->dev, "peripheral-id %u: hook failed %d\n", periph, ret);
+    goto out_port;
+  }
+
+  DBG_PRINT("probed line %d periph %02X\n", line, periph);
   return 0;
+
+out_port:
+  uart_remove_one_port(&x8h7_uart, &sport->port);
+out_wq:
+  destroy_workqueue(sport->workqueue);
+out_line:
+  mutex_lock(&x8h7_uart_ports_lock);
+  x8h7_uart_ports[line] = NULL;
+  mutex_unlock(&x8h7_uart_ports_lock);
+  return ret;
 }
 
 static int x8h7_uart_remove(struct platform_device *pdev)
 {
   struct x8h7_uart_port *sport = platform_get_drvdata(pdev);
 
+  x8h7_hook_set(sport->periph, NULL, NULL);
+  uart_remove_one_port(&x8h7_uart, &sport->port);
   DBG_PRINT("destroying work queue\n");
   destroy_workqueue(sport->workqueue);
-  if (sport) {
-    uart_remove_one_port(&x8h7_uart, &sport->port);
-  }
+
+  mutex_lock(&x8h7_uart_ports_lock);
+  x8h7_uart_ports[sport->port.line] = NULL;
+  mutex_unlock(&x8h7_uart_ports_lock);
   return 0;
 }
 
@@ -8,6 +8,10 @@
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
 #include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
 
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
@@ -24,7 +28,9 @@
 // Op code
 #define X8H7_UI_OC_DATA     0x01
 
-#define X8H7_UI_DATA_MAX    (1 * 1024)
+#define X8H7_UI_DATA_MAX    (4 * 1024)
+/* Below this much frame room a chunk waits for the next frame */
+#define X8H7_UI_CHUNK_MIN   32
 
 struct x8h7_ui_priv {
   struct device      *dev;
@@ -32,28 +38,71 @@ struct x8h7_ui_priv {
   struct cdev         cdev;
   struct class       *cl;
 
-  uint8_t             rx_data[X8H7_UI_DATA_MAX];
-  uint16_t            rx_len;
+  /* Each fifo has one producer and one consumer, the mutexes
+   * serialize the userspace side only.
+   */
+  struct mutex        rx_lock;
+  wait_queue_head_t   rx_wait;
+  u64                 rx_dropped;
+  DECLARE_KFIFO(rx_fifo, u8, X8H7_UI_DATA_MAX);
+
+  struct mutex        tx_lock;
+  wait_queue_head_t   tx_wait;
+  struct work_struct  tx_work;
+  DECLARE_KFIFO(tx_fifo, u8, X8H7_UI_DATA_MAX);
 };
 
-static DECLARE_WAIT_QUEUE_HEAD(wq);
-
 struct x8h7_ui_priv *x8h7_ui;
 
-static void x8h7_ui_hook(void *prv, x8h7_pkt_t *pkt)
+static void x8h7_ui_hook(void *prv, uint8_t opcode, const uint8_t *data,
+                         uint16_t size)
 {
   struct x8h7_ui_priv  *priv = (struct x8h7_ui_priv*)prv;
+  unsigned int          len;
 
-  //DBG_PRINT("received %d bytes\n", pkt->size);
-  if (priv->rx_len + pkt->size > X8H7_UI_DATA_MAX) {
-    goto wake_read;
+  //DBG_PRINT("received %d bytes\n", size);
+  len = kfifo_in(&priv->rx_fifo, data, size);
+  if (len < size) {
+    priv->rx_dropped += size - len;
+    DBG_ERROR("rx overrun, dropped %llu\n", priv->rx_dropped);
   }
 
-  memcpy(&priv->rx_data[priv->rx_len], pkt->data, pkt->size);
-  priv->rx_len += pkt->size;
+  wake_up_interruptible(&priv->rx_wait);
+}
 
-wake_read:
-  wake_up_interruptible(&wq);
+/**
+ * Drain the tx fifo into the frame being filled, sub packets sized to
+ * the room left so they share frames with the other peripherals.
+ */
+static void x8h7_ui_tx_work_func(struct work_struct *work)
+{
+  struct x8h7_ui_priv  *priv = container_of(work, struct x8h7_ui_priv, tx_work);
+  uint8_t               data[X8H7_PKT_SIZE];
+  unsigned int          len;
+  unsigned int          room;
+  int                   ret;
+
+  while ((len = kfifo_len(&priv->tx_fifo)) != 0) {
+    room = x8h7_pkt_room();
+    if (room < min_t(unsigned int, len, X8H7_UI_CHUNK_MIN)) {
+      x8h7_pkt_send_now();
+      room = x8h7_pkt_room();
+    }
+    len = min3(len, room, (unsigned int)X8H7_PKT_SIZE);
+    len = kfifo_out(&priv->tx_fifo, data, len);
+    wake_up_interruptible(&priv->tx_wait);
+
+    ret = x8h7_pkt_send_defer(X8H7_UI_PERIPH, X8H7_UI_OC_DATA, len, data);
+    if (ret == -ENOMEM) {
+      /* Room taken by another producer meanwhile */
+      x8h7_pkt_send_now();
+      ret = x8h7_pkt_send_defer(X8H7_UI_PERIPH, X8H7_UI_OC_DATA, len, data);
+    }
+    if (ret < 0) {
+      DBG_ERROR("lost %u bytes: %d\n", len, ret);
+    }
+  }
+  x8h7_pkt_send_now();
 }
 
 static int x8h7_ui_open(struct inode *inode, struct file *file)
@@ -80,41 +129,84 @@ static ssize_t x8h7_ui_read(struct file *file,
                             char __user *buf, size_t count, loff_t *offset)
 {
   struct x8h7_ui_priv *priv = x8h7_ui;
-  ssize_t ret;
+  unsigned int         copied;
+  int                  ret;
 
-  // call this only in case of O_BLOCK
-  wait_event_interruptible(wq, priv->rx_len != 0);
+  if (mutex_lock_interruptible(&priv->rx_lock)) {
+    return -ERESTARTSYS;
+  }
+  while (kfifo_is_empty(&priv->rx_fifo)) {
+    mutex_unlock(&priv->rx_lock);
+    if (file->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(priv->rx_wait, !kfifo_is_empty(&priv->rx_fifo))) {
+      return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&priv->rx_lock)) {
+      return -ERESTARTSYS;
+    }
+  }
 
-  *offset = 0;
   //DBG_PRINT("cpoy to user %d bytes\n", count);
-  ret = simple_read_from_buffer(buf, count, offset, priv->rx_data, priv->rx_len);
-  priv->rx_len = 0;
+  ret = kfifo_to_user(&priv->rx_fifo, buf, count, &copied);
+  mutex_unlock(&priv->rx_lock);
 
-  return ret;
+  return ret ? ret : copied;
 }
 
 static ssize_t x8h7_ui_write(struct file *file,
                              const char __user *buf, size_t count, loff_t *offset)
 {
-  size_t          len;
-  unsigned long   ret;
-  uint8_t         data[X8H7_UI_DATA_MAX];
-
-  if (count >= X8H7_UI_DATA_MAX) {
-    len = X8H7_UI_DATA_MAX;
-  } else {
-    len = count;
+  struct x8h7_ui_priv *priv = x8h7_ui;
+  unsigned int         copied;
+  int                  ret;
+
+  if (mutex_lock_interruptible(&priv->tx_lock)) {
+    return -ERESTARTSYS;
+  }
+  while (kfifo_is_full(&priv->tx_fifo)) {
+    mutex_unlock(&priv->tx_lock);
+    if (file->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(priv->tx_wait, !kfifo_is_full(&priv->tx_fifo))) {
+      return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&priv->tx_lock)) {
+      return -ERESTARTSYS;
+    }
   }
 
-  ret = copy_from_user(data, buf, len);
+  /* Whatever fits, the rest is a short write */
+  ret = kfifo_from_user(&priv->tx_fifo, buf, count, &copied);
+  mutex_unlock(&priv->tx_lock);
   if (ret) {
-    DBG_ERROR("Could't copy %zd bytes from the user\n", ret);
-    return -EFAULT;
+    DBG_ERROR("Could't copy %zd bytes from the user\n", count);
+    return ret;
   }
 
-  x8h7_pkt_send_sync(X8H7_UI_PERIPH, X8H7_UI_OC_DATA, len, data);
+  schedule_work(&priv->tx_work);
 
-  return len;
+  return copied;
+}
+
+static __poll_t x8h7_ui_poll(struct file *file, poll_table *wait)
+{
+  struct x8h7_ui_priv *priv = x8h7_ui;
+  __poll_t             mask = 0;
+
+  poll_wait(file, &priv->rx_wait, wait);
+  poll_wait(file, &priv->tx_wait, wait);
+
+  if (!kfifo_is_empty(&priv->rx_fifo)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  if (!kfifo_is_full(&priv->tx_fifo)) {
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  }
+
+  return mask;
 }
 
  struct file_operations fops = {
@@ -122,6 +214,8 @@ static ssize_t x8h7_ui_write(struct file *file,
   .release = x8h7_ui_release,
   .read    = x8h7_ui_read,
   .write   = x8h7_ui_write,
+  .poll    = x8h7_ui_poll,
+  .llseek  = no_llseek,
 };
 
 static int x8h7_ui_probe(struct platform_device *pdev)
@@ -144,6 +238,14 @@ static int x8h7_ui_probe(struct platform_device *pdev)
   x8h7_ui = priv;
   platform_set_drvdata(pdev, priv);
 
+  mutex_init(&priv->rx_lock);
+  init_waitqueue_head(&priv->rx_wait);
+  INIT_KFIFO(priv->rx_fifo);
+  mutex_init(&priv->tx_lock);
+  init_waitqueue_head(&priv->tx_wait);
+  INIT_WORK(&priv->tx_work, x8h7_ui_tx_work_func);
+  INIT_KFIFO(priv->tx_fifo);
+
   /* we will get the major number dynamically this is recommended please read ldd3*/
   ret = alloc_chrdev_region(&priv->dev_num, 0, 1, DRIVER_NAME);
   if (ret < 0) {
@@ -179,8 +281,6 @@ static int x8h7_ui_probe(struct platform_device *pdev)
     return -1;
   }
 
-  x8h7_ui->rx_len = 0;
-
   x8h7_hook_set(X8H7_UI_PERIPH, x8h7_ui_hook, priv);
 
   return 0;
@@ -192,6 +292,7 @@ static int x8h7_ui_remove(struct platform_device *pdev)
 
   x8h7_hook_set(X8H7_UI_PERIPH, NULL, NULL);
   cdev_del(&priv->cdev);
+  cancel_work_sync(&priv->tx_work);
   device_destroy(priv->cl, priv->dev_num);
   class_destroy(priv->cl);
   unregister_chrdev_region(priv->dev_num, 1);